@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IPREMAPD_BASIC_MAPPER_H_
+#define IPREMAPD_BASIC_MAPPER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "clock.h"
+#include "endpoint.h"
+#include "eviction.h"
+#include "mapper.h"
+
+namespace ipremapd {
+
+// The mapping table specialized for an eviction policy. The request path,
+// from Map() to ReleaseLease(), is not virtual and is defined below, so the
+// daemon picks the policy once at startup and runs on the concrete type,
+// see WithPolicy().
+template <typename Policy>
+class BasicMapper final : public Mapper {
+ public:
+  template <typename... Args>
+  explicit BasicMapper(Args &&... args)
+      : Mapper(Policy::kPolicy, std::forward<Args>(args)...),
+        policy_(max_size()) {
+    map_.reserve(max_size());
+  }
+
+  Endpoint Map(const Endpoint &orig);
+  void Idle();
+
+  // Like Map(), but keeps the mapping for at least ttl after its last use.
+  // The ttl is capped by max_ttl(), zero selects the default. Stores the
+  // ttl the mapping keeps, which may be a longer one of another lease, in
+  // granted_ttl.
+  Endpoint Lease(const Endpoint &orig, std::chrono::system_clock::duration ttl,
+                 std::chrono::system_clock::duration *granted_ttl);
+  // Returns false if orig is not mapped.
+  bool RenewLease(const Endpoint &orig,
+                  std::chrono::system_clock::duration ttl, Endpoint *nat,
+                  std::chrono::system_clock::duration *granted_ttl);
+  // Gives back a lease taken by Lease(). The last one forgets the mapping
+  // at once; its rule is deleted by the next CommitReleases() together
+  // with those of other released mappings. Returns false if orig is not
+  // mapped.
+  bool ReleaseLease(const Endpoint &orig);
+
+  std::size_t Preload(const std::vector<in_addr> &orig_addrs) override;
+
+  void Insert(const Endpoint &orig, const Endpoint &nat,
+              std::chrono::system_clock::time_point last_access,
+              std::chrono::system_clock::duration ttl) override;
+  void Erase(const Endpoint &orig) override;
+  void Clear() override;
+  void Adopt(const Endpoint &orig, const Endpoint &nat,
+             std::chrono::system_clock::time_point last_access,
+             std::chrono::system_clock::duration ttl) override;
+
+  template <typename F>
+  void ForEachMapping(F visitor) const {
+    for (const auto &pair : map_) {
+      visitor(pair.first, pair.second.nat, pair.second.last_access,
+              pair.second.ttl);
+    }
+  }
+  bool ReverseLookup(const Endpoint &nat,
+                     const MappingVisitor &visitor) const override;
+
+  std::size_t mapped_count() const override { return map_.size(); }
+  bool is_full() const {
+    return map_.size() + released_count() >= max_size();
+  }
+
+ protected:
+  void EvictColdest(std::size_t count) override;
+
+  std::size_t bucket_count() const override { return map_.bucket_count(); }
+  void VisitBucket(std::size_t bucket, std::uint32_t epoch,
+                   const MappingVisitor &visitor) const override;
+
+ private:
+  struct Mapping {
+    // Leases of mappings installed by Insert() or Adopt().
+    static constexpr std::uint32_t kUnknownLeases = UINT32_MAX;
+
+    Mapping(const Endpoint &nat,
+            std::chrono::system_clock::time_point last_access,
+            std::chrono::system_clock::duration ttl, std::uint32_t epoch)
+        : nat(nat), last_access(last_access), ttl(ttl), epoch(epoch),
+          leases(0) {
+    }
+
+    bool IsExpired(std::chrono::system_clock::time_point now) const {
+      // Zero TTL means forever.
+      return ttl != std::chrono::system_clock::duration::zero()
+          && now - last_access > ttl;
+    }
+
+    Endpoint nat;
+    std::chrono::system_clock::time_point last_access;
+    std::chrono::system_clock::duration ttl;
+    std::uint32_t epoch;
+    // Taken by Lease() and not yet released.
+    std::uint32_t leases;
+    typename Policy::Entry entry;
+  };
+
+  typedef std::unordered_map<Endpoint, Mapping, EndpointHash>
+  unordered_mapping_map;
+
+  typename unordered_mapping_map::iterator ReallyMap(
+      const Endpoint &orig, std::chrono::system_clock::duration ttl);
+  typename unordered_mapping_map::iterator AddMapping(
+      const Endpoint &orig, const Endpoint &nat,
+      std::chrono::system_clock::time_point last_access,
+      std::chrono::system_clock::duration ttl);
+  typename unordered_mapping_map::iterator Record(
+      const Endpoint &orig, const Endpoint &nat,
+      std::chrono::system_clock::time_point last_access,
+      std::chrono::system_clock::duration ttl);
+  void SetTtl(typename unordered_mapping_map::iterator it,
+              std::chrono::system_clock::duration ttl);
+  // Zero means forever.
+  static std::chrono::system_clock::duration LongerTtl(
+      std::chrono::system_clock::duration a,
+      std::chrono::system_clock::duration b) {
+    if (a == std::chrono::system_clock::duration::zero()
+        || b == std::chrono::system_clock::duration::zero()) {
+      return std::chrono::system_clock::duration::zero();
+    }
+    return std::max(a, b);
+  }
+  typename unordered_mapping_map::iterator Unmap(
+      typename unordered_mapping_map::iterator it,
+      MapperEvent event = MapperEvent::kUnmap);
+  void UnmapOne();
+  void SetAside(typename unordered_mapping_map::const_iterator it) {
+    Mapper::SetAside(map_.bucket(it->first), it->second.epoch, it->first,
+                     it->second.nat, it->second.last_access, it->second.ttl);
+  }
+
+  Policy policy_;
+  unordered_mapping_map map_;
+};
+
+template <typename Policy>
+inline Endpoint BasicMapper<Policy>::Map(const Endpoint &orig) {
+  auto it = map_.find(orig);
+  if (it == map_.end()) {
+    return ReallyMap(orig, ttl())->second.nat;
+  } else {
+    policy_.Hit(it->second.entry, it->second.last_access);
+    return it->second.nat;
+  }
+}
+
+template <typename Policy>
+inline Endpoint BasicMapper<Policy>::Lease(
+    const Endpoint &orig, std::chrono::system_clock::duration ttl,
+    std::chrono::system_clock::duration *granted_ttl) {
+  ttl = GrantedTtl(ttl);
+  auto it = map_.find(orig);
+  if (it == map_.end()) {
+    *granted_ttl = ttl;
+    it = ReallyMap(orig, ttl);
+    it->second.leases = 1;
+    return it->second.nat;
+  }
+  if (it->second.leases != Mapping::kUnknownLeases) {
+    ++it->second.leases;
+  }
+  // Leasing restarts the TTL regardless of how the policy treats hits.
+  policy_.Hit(it->second.entry, it->second.last_access);
+  it->second.last_access = MapperClock::now();
+  // Other clients may rely on the longer lease.
+  SetTtl(it, LongerTtl(it->second.ttl, ttl));
+  *granted_ttl = it->second.ttl;
+  return it->second.nat;
+}
+
+template <typename Policy>
+inline bool BasicMapper<Policy>::RenewLease(
+    const Endpoint &orig, std::chrono::system_clock::duration ttl,
+    Endpoint *nat, std::chrono::system_clock::duration *granted_ttl) {
+  auto it = map_.find(orig);
+  if (it == map_.end()) {
+    return false;
+  }
+  policy_.Hit(it->second.entry, it->second.last_access);
+  it->second.last_access = MapperClock::now();
+  // As in Lease(), a shorter renewal leaves a longer lease alone.
+  SetTtl(it, LongerTtl(it->second.ttl, GrantedTtl(ttl)));
+  *nat = it->second.nat;
+  *granted_ttl = it->second.ttl;
+  return true;
+}
+
+template <typename Policy>
+inline bool BasicMapper<Policy>::ReleaseLease(const Endpoint &orig) {
+  auto it = map_.find(orig);
+  if (it == map_.end()) {
+    return false;
+  }
+  // Other clients still hold the mapping, which lives until it expires.
+  if (it->second.leases == Mapping::kUnknownLeases) {
+    return true;
+  } else if (it->second.leases > 1) {
+    --it->second.leases;
+    return true;
+  }
+  const Endpoint nat = it->second.nat;
+  const auto ttl = it->second.ttl;
+  DeferDeleteRule(orig, nat);
+  policy_.Erased(it->second.entry);
+  SetAside(it);
+  map_.erase(it);
+  Notify(MapperEvent::kUnmap, orig, nat, ttl);
+  return true;
+}
+
+template <typename Policy>
+inline void BasicMapper<Policy>::SetTtl(
+    typename unordered_mapping_map::iterator it,
+    std::chrono::system_clock::duration ttl) {
+  if (ttl != it->second.ttl) {
+    it->second.ttl = ttl;
+    Notify(MapperEvent::kMap, it->first, it->second.nat, ttl);
+  }
+}
+
+// The rest is defined in mapper.cc.
+extern template class BasicMapper<LruPolicy>;
+extern template class BasicMapper<ClockPolicy>;
+extern template class BasicMapper<TtlOnlyPolicy>;
+extern template class BasicMapper<FrequencyPolicy>;
+
+// Returns F<Policy>::Run(args...) for the Policy class of policy.
+template <template <typename> class F, typename... Args>
+auto WithPolicy(EvictionPolicy policy, Args &&... args)
+    -> decltype(F<LruPolicy>::Run(std::forward<Args>(args)...)) {
+  switch (policy) {
+    case EvictionPolicy::kLru:
+      return F<LruPolicy>::Run(std::forward<Args>(args)...);
+    case EvictionPolicy::kClock:
+      return F<ClockPolicy>::Run(std::forward<Args>(args)...);
+    case EvictionPolicy::kTtlOnly:
+      return F<TtlOnlyPolicy>::Run(std::forward<Args>(args)...);
+    case EvictionPolicy::kFrequency:
+      return F<FrequencyPolicy>::Run(std::forward<Args>(args)...);
+  }
+  throw std::invalid_argument("unknown eviction policy.");
+}
+
+template <typename F>
+void Mapper::ForEachMapping(F visitor) const {
+  switch (eviction()) {
+    case EvictionPolicy::kLru:
+      static_cast<const BasicMapper<LruPolicy> &>(*this).ForEachMapping(
+          visitor);
+      return;
+    case EvictionPolicy::kClock:
+      static_cast<const BasicMapper<ClockPolicy> &>(*this).ForEachMapping(
+          visitor);
+      return;
+    case EvictionPolicy::kTtlOnly:
+      static_cast<const BasicMapper<TtlOnlyPolicy> &>(*this).ForEachMapping(
+          visitor);
+      return;
+    case EvictionPolicy::kFrequency:
+      static_cast<const BasicMapper<FrequencyPolicy> &>(*this).ForEachMapping(
+          visitor);
+      return;
+  }
+}
+
+} // namespace ipremapd
+
+#endif // IPREMAPD_BASIC_MAPPER_H_
@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "clock.h"
+
+namespace ipremapd {
+
+MapperClock::time_point MapperClock::now_;
+
+} // namespace ipremapd
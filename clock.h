@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IPREMAPD_CLOCK_H_
+#define IPREMAPD_CLOCK_H_
+
+#include <chrono>
+
+namespace ipremapd {
+
+// The time as the mapping table sees it. It is the real time, unless trace
+// replay sets it to run the table faster than real time.
+class MapperClock {
+ public:
+  typedef std::chrono::system_clock::time_point time_point;
+
+  static time_point now() {
+    return simulated() ? now_ : std::chrono::system_clock::now();
+  }
+  static std::chrono::steady_clock::time_point steady_now() {
+    if (!simulated()) {
+      return std::chrono::steady_clock::now();
+    }
+    return std::chrono::steady_clock::time_point(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            now_.time_since_epoch()));
+  }
+
+  // Stops the clock at time. The epoch restarts the real clock.
+  static void Set(time_point time) { now_ = time; }
+
+ private:
+  static bool simulated() { return now_ != time_point(); }
+
+  static time_point now_;
+};
+
+} // namespace ipremapd
+
+#endif // IPREMAPD_CLOCK_H_
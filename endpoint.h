@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IPREMAPD_ENDPOINT_H_
+#define IPREMAPD_ENDPOINT_H_
+
+#include <cstdint>
+#include <functional>
+
+#include <arpa/inet.h>
+
+namespace ipremapd {
+
+// An IPv4 address, or a port of a transport protocol on one.
+struct Endpoint {
+  Endpoint() : port(0), proto(0) {
+    addr.s_addr = 0;
+  }
+  Endpoint(const in_addr &addr, std::uint16_t port = 0,
+           std::uint8_t proto = 0)
+      : addr(addr), port(port), proto(proto) {
+  }
+
+  bool has_port() const { return port != 0; }
+  // Distinct for distinct endpoints.
+  std::uint64_t packed() const {
+    return static_cast<std::uint64_t>(addr.s_addr) << 24
+        | static_cast<std::uint64_t>(port) << 8 | proto;
+  }
+
+  in_addr addr;
+  // Host byte order, zero for the whole address.
+  std::uint16_t port;
+  // IPPROTO_TCP or IPPROTO_UDP if port is set, zero otherwise.
+  std::uint8_t proto;
+};
+
+inline bool operator==(const Endpoint &a, const Endpoint &b) {
+  return a.packed() == b.packed();
+}
+
+inline bool operator!=(const Endpoint &a, const Endpoint &b) {
+  return !(a == b);
+}
+
+struct EndpointHash {
+  std::size_t operator()(const Endpoint &e) const {
+    return std::hash<std::uint64_t>()(e.packed());
+  }
+};
+
+} // namespace ipremapd
+
+#endif // IPREMAPD_ENDPOINT_H_
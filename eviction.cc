@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "eviction.h"
+
+namespace ipremapd {
+
+constexpr std::uint8_t ClockPolicy::Entry::kReferenced;
+constexpr std::uint8_t ClockPolicy::Entry::kSeen;
+constexpr std::uint8_t FrequencyPolicy::Entry::kReferenced;
+constexpr std::uint8_t FrequencyPolicy::Entry::kSeen;
+constexpr std::uint8_t FrequencyPolicy::Entry::kProtected;
+constexpr int FrequencySketch::kDepth;
+constexpr std::uint8_t FrequencySketch::kMaxCount;
+
+static const std::uint64_t kSeeds[] = {
+  0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+  0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL
+};
+
+FrequencySketch::FrequencySketch(std::size_t capacity) : additions_(0) {
+  std::size_t width = 64;
+  while (width < 4 * capacity) {
+    width *= 2;
+  }
+  table_.assign(width, 0);
+  mask_ = width - 1;
+  sample_size_ = 10 * capacity;
+}
+
+std::uint8_t FrequencySketch::Estimate(const Endpoint &key) const {
+  std::uint8_t min = kMaxCount;
+  for (int row = 0; row < kDepth; ++row) {
+    min = std::min(min, table_[Index(key, row)]);
+  }
+  return min;
+}
+
+void FrequencySketch::Increment(const Endpoint &key) {
+  for (int row = 0; row < kDepth; ++row) {
+    std::uint8_t &counter = table_[Index(key, row)];
+    if (counter < kMaxCount) {
+      ++counter;
+    }
+  }
+  if (++additions_ >= sample_size_) {
+    Halve();
+  }
+}
+
+std::size_t FrequencySketch::Index(const Endpoint &key, int row) const {
+  std::uint64_t h = (key.packed() + row)
+      * kSeeds[row];
+  return static_cast<std::size_t>(h >> 32) & mask_;
+}
+
+void FrequencySketch::Halve() {
+  for (auto &counter : table_) {
+    counter >>= 1;
+  }
+  additions_ /= 2;
+}
+
+} // namespace ipremapd
@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IPREMAPD_EVICTION_H_
+#define IPREMAPD_EVICTION_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "clock.h"
+#include "endpoint.h"
+
+// Eviction policies plugged into the mapping table at compile time.
+//
+// Each policy keeps an Entry in every mapping and is told about insertions,
+// erasures and hits. Sweep() runs on every mapping from Idle() and
+// may refresh the last access time of mappings hit since the previous
+// sweep, which lets policies avoid reading the clock on hits. Victim()
+// picks the mapping to evict from a table whose values have last_access
+// and entry members, and EvictColdest() passes the count coldest ones to
+// a function erasing them.
+
+namespace ipremapd {
+
+typedef std::chrono::system_clock::time_point time_point;
+
+enum class EvictionPolicy {
+  // Evicts the least recently used mapping; every hit stores a timestamp.
+  kLru,
+  // Second chance: a hit only sets a reference bit.
+  kClock,
+  // Ignores hits; mappings live for their TTL after being mapped, leased
+  // or renewed, and the oldest is evicted first.
+  kTtlOnly,
+  // Segmented CLOCK that only admits addresses mapped recently before into
+  // the protected segment, so a scan of one-off addresses cannot flush out
+  // long-lived hot ones.
+  kFrequency
+};
+
+// The ring of entries swept by a CLOCK hand. Entries must stay at a fixed
+// address while in the ring, which unordered_map guarantees.
+template <typename Entry>
+class ClockRing {
+ public:
+  explicit ClockRing(std::size_t capacity) : hand_(0) {
+    ring_.reserve(capacity);
+  }
+
+  void Insert(const Endpoint &key, Entry &entry) {
+    entry.slot = ring_.size();
+    ring_.emplace_back(key, &entry);
+  }
+
+  void Erase(Entry &entry) {
+    auto &last = ring_.back();
+    last.second->slot = entry.slot;
+    ring_[entry.slot] = last;
+    ring_.pop_back();
+  }
+
+  bool empty() const { return ring_.empty(); }
+  std::size_t size() const { return ring_.size(); }
+
+  // The entry under the hand; the ring must not be empty.
+  std::pair<Endpoint, Entry *> &Hand() {
+    if (hand_ >= ring_.size()) {
+      hand_ = 0;
+    }
+    return ring_[hand_];
+  }
+  void Next() { ++hand_; }
+
+ private:
+  std::vector<std::pair<Endpoint, Entry *>> ring_;
+  std::size_t hand_;
+};
+
+class LruPolicy {
+ public:
+  static constexpr EvictionPolicy kPolicy = EvictionPolicy::kLru;
+
+  struct Entry {
+  };
+
+  explicit LruPolicy(std::size_t) {}
+
+  void Inserted(const Endpoint &, Entry &) {}
+  void Erased(Entry &) {}
+  void Hit(Entry &, time_point &last_access) {
+    last_access = MapperClock::now();
+  }
+  void Sweep(Entry &, time_point &, time_point) {}
+
+  template <typename Map>
+  typename Map::iterator Victim(Map &map) {
+    return OldestAccess(map);
+  }
+  template <typename Map, typename Evict>
+  void EvictColdest(Map &map, std::size_t count, Evict evict) {
+    EvictOldest(map, count, evict);
+  }
+
+  template <typename Map>
+  static typename Map::iterator OldestAccess(Map &map) {
+    typedef typename Map::const_reference cref;
+    return std::min_element(
+        map.begin(), map.end(), [](cref a, cref b) {
+          return a.second.last_access < b.second.last_access;
+        });
+  }
+
+  // One partial sort rather than a scan per eviction.
+  template <typename Map, typename Evict>
+  static void EvictOldest(Map &map, std::size_t count, Evict evict) {
+    typedef typename Map::iterator iterator;
+    std::vector<iterator> its;
+    its.reserve(map.size());
+    for (auto it = map.begin(); it != map.end(); ++it) {
+      its.push_back(it);
+    }
+    std::nth_element(its.begin(), its.begin() + count, its.end(),
+                     [](iterator a, iterator b) {
+                       return a->second.last_access < b->second.last_access;
+                     });
+    for (std::size_t i = 0; i < count; ++i) {
+      evict(its[i]);
+    }
+  }
+};
+
+class ClockPolicy {
+ public:
+  static constexpr EvictionPolicy kPolicy = EvictionPolicy::kClock;
+
+  struct Entry {
+    static constexpr std::uint8_t kReferenced = 1;
+    static constexpr std::uint8_t kSeen = 2;
+
+    std::size_t slot;
+    std::uint8_t flags;
+  };
+
+  explicit ClockPolicy(std::size_t capacity) : ring_(capacity) {}
+
+  void Inserted(const Endpoint &key, Entry &entry) {
+    entry.flags = 0;
+    ring_.Insert(key, entry);
+  }
+  void Erased(Entry &entry) { ring_.Erase(entry); }
+  void Hit(Entry &entry, time_point &) {
+    entry.flags = Entry::kReferenced | Entry::kSeen;
+  }
+  void Sweep(Entry &entry, time_point &last_access, time_point now) {
+    if ((entry.flags & Entry::kSeen) != 0) {
+      entry.flags &= static_cast<std::uint8_t>(~Entry::kSeen);
+      last_access = now;
+    }
+  }
+
+  template <typename Map>
+  typename Map::iterator Victim(Map &map) {
+    for (;;) {
+      auto &hand = ring_.Hand();
+      if ((hand.second->flags & Entry::kReferenced) == 0) {
+        return map.find(hand.first);
+      }
+      hand.second->flags &= static_cast<std::uint8_t>(~Entry::kReferenced);
+      ring_.Next();
+    }
+  }
+  template <typename Map, typename Evict>
+  void EvictColdest(Map &map, std::size_t count, Evict evict) {
+    for (std::size_t i = 0; i < count; ++i) {
+      evict(Victim(map));
+    }
+  }
+
+ private:
+  ClockRing<Entry> ring_;
+};
+
+class TtlOnlyPolicy {
+ public:
+  static constexpr EvictionPolicy kPolicy = EvictionPolicy::kTtlOnly;
+
+  struct Entry {
+  };
+
+  explicit TtlOnlyPolicy(std::size_t) {}
+
+  void Inserted(const Endpoint &, Entry &) {}
+  void Erased(Entry &) {}
+  void Hit(Entry &, time_point &) {}
+  void Sweep(Entry &, time_point &, time_point) {}
+
+  template <typename Map>
+  typename Map::iterator Victim(Map &map) {
+    return LruPolicy::OldestAccess(map);
+  }
+  template <typename Map, typename Evict>
+  void EvictColdest(Map &map, std::size_t count, Evict evict) {
+    LruPolicy::EvictOldest(map, count, evict);
+  }
+};
+
+// Approximate counts of recently mapped addresses in a count-min sketch of
+// saturating counters, halved periodically so that old popularity fades.
+class FrequencySketch {
+ public:
+  explicit FrequencySketch(std::size_t capacity);
+
+  std::uint8_t Estimate(const Endpoint &key) const;
+  void Increment(const Endpoint &key);
+
+ private:
+  static constexpr int kDepth = 4;
+  static constexpr std::uint8_t kMaxCount = 15;
+
+  std::size_t Index(const Endpoint &key, int row) const;
+  void Halve();
+
+  std::vector<std::uint8_t> table_;
+  std::size_t mask_;
+  std::size_t additions_;
+  std::size_t sample_size_;
+};
+
+// Segmented CLOCK with frequency-based admission. Addresses the sketch has
+// seen before go to the protected segment, others to a probation segment
+// which is evicted from first, so a scan only churns probation. Probation
+// entries hit before the hand reaches them are promoted, and the protected
+// segment is trimmed back to its share by demoting its CLOCK victims.
+class FrequencyPolicy {
+ public:
+  static constexpr EvictionPolicy kPolicy = EvictionPolicy::kFrequency;
+
+  struct Entry {
+    static constexpr std::uint8_t kReferenced = 1;
+    static constexpr std::uint8_t kSeen = 2;
+    static constexpr std::uint8_t kProtected = 4;
+
+    std::size_t slot;
+    std::uint8_t flags;
+  };
+
+  explicit FrequencyPolicy(std::size_t capacity)
+      : protected_share_(capacity - capacity / 5), probation_(capacity),
+        protected_(capacity), sketch_(capacity) {}
+
+  void Inserted(const Endpoint &key, Entry &entry) {
+    bool admit = sketch_.Estimate(key) > 0;
+    sketch_.Increment(key);
+    entry.flags = 0;
+    if (admit) {
+      entry.flags = Entry::kProtected;
+      protected_.Insert(key, entry);
+    } else {
+      probation_.Insert(key, entry);
+    }
+  }
+  void Erased(Entry &entry) { Segment(entry).Erase(entry); }
+  void Hit(Entry &entry, time_point &) {
+    entry.flags |= Entry::kReferenced | Entry::kSeen;
+  }
+  void Sweep(Entry &entry, time_point &last_access, time_point now) {
+    if ((entry.flags & Entry::kSeen) != 0) {
+      entry.flags &= static_cast<std::uint8_t>(~Entry::kSeen);
+      last_access = now;
+    }
+  }
+
+  template <typename Map>
+  typename Map::iterator Victim(Map &map) {
+    for (;;) {
+      if (protected_.size() > protected_share_) {
+        auto &hand = protected_.Hand();
+        if (Unreference(*hand.second)) {
+          protected_.Next();
+        } else {
+          Move(hand.first, *hand.second, protected_, probation_);
+        }
+      } else if (probation_.empty()) {
+        auto &hand = protected_.Hand();
+        if (!Unreference(*hand.second)) {
+          return map.find(hand.first);
+        }
+        protected_.Next();
+      } else {
+        auto &hand = probation_.Hand();
+        if (!Unreference(*hand.second)) {
+          return map.find(hand.first);
+        }
+        Move(hand.first, *hand.second, probation_, protected_);
+      }
+    }
+  }
+  template <typename Map, typename Evict>
+  void EvictColdest(Map &map, std::size_t count, Evict evict) {
+    for (std::size_t i = 0; i < count; ++i) {
+      evict(Victim(map));
+    }
+  }
+
+ private:
+  ClockRing<Entry> &Segment(const Entry &entry) {
+    return (entry.flags & Entry::kProtected) != 0 ? protected_ : probation_;
+  }
+
+  // Clears the reference bit and returns whether it was set.
+  static bool Unreference(Entry &entry) {
+    bool referenced = (entry.flags & Entry::kReferenced) != 0;
+    entry.flags &= static_cast<std::uint8_t>(~Entry::kReferenced);
+    return referenced;
+  }
+
+  static void Move(Endpoint key, Entry &entry, ClockRing<Entry> &from,
+                   ClockRing<Entry> &to) {
+    from.Erase(entry);
+    entry.flags ^= Entry::kProtected;
+    to.Insert(key, entry);
+  }
+
+  std::size_t protected_share_;
+  ClockRing<Entry> probation_;
+  ClockRing<Entry> protected_;
+  FrequencySketch sketch_;
+};
+
+} // namespace ipremapd
+
+#endif // IPREMAPD_EVICTION_H_
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays an address trace against each eviction policy and reports the hit
+// ratio and the cost of a hit. Without a trace file, a Zipf-distributed hot
+// set interleaved with scans over one-off addresses is generated. TTLs are
+// not simulated, so the TTL-only policy evicts in insertion order.
+//
+// usage: eviction_bench [CAPACITY [TRACE]]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "eviction.h"
+#include "preload.h"
+
+namespace {
+
+using namespace ipremapd;
+
+// The parts of the mapping table that the policies see.
+template <typename Policy>
+class Table {
+ public:
+  explicit Table(std::size_t capacity)
+      : capacity_(capacity), policy_(capacity) {
+    map_.reserve(capacity);
+  }
+
+  // Returns true on a hit.
+  bool Access(const Endpoint &addr) {
+    auto it = map_.find(addr);
+    if (it != map_.end()) {
+      policy_.Hit(it->second.entry, it->second.last_access);
+      return true;
+    }
+    if (map_.size() >= capacity_) {
+      auto victim = policy_.Victim(map_);
+      policy_.Erased(victim->second.entry);
+      map_.erase(victim);
+    }
+    auto res = map_.emplace(addr, Slot());
+    res.first->second.last_access = std::chrono::system_clock::now();
+    policy_.Inserted(addr, res.first->second.entry);
+    return false;
+  }
+
+ private:
+  struct Slot {
+    time_point last_access;
+    typename Policy::Entry entry;
+  };
+
+  std::size_t capacity_;
+  Policy policy_;
+  std::unordered_map<Endpoint, Slot, EndpointHash> map_;
+};
+
+in_addr Address(std::uint32_t n) {
+  in_addr addr;
+  addr.s_addr = htonl(n);
+  return addr;
+}
+
+std::vector<in_addr> SyntheticTrace(std::size_t capacity) {
+  const std::size_t hot_count = 4 * capacity;
+  const std::size_t length = 2000 * capacity;
+  const std::size_t scan_period = 50 * capacity;
+  const std::size_t scan_length = 2 * capacity;
+
+  std::vector<double> cdf(hot_count);
+  double sum = 0;
+  for (std::size_t i = 0; i < hot_count; ++i) {
+    sum += 1.0 / (i + 1);
+    cdf[i] = sum;
+  }
+  std::mt19937 rand(42);
+  std::uniform_real_distribution<double> dist(0, sum);
+  std::uint32_t next_cold = 0x0a000000;
+
+  std::vector<in_addr> trace;
+  trace.reserve(length);
+  while (trace.size() < length) {
+    if (trace.size() % scan_period == scan_period - 1) {
+      for (std::size_t i = 0; i < scan_length; ++i) {
+        trace.push_back(Address(next_cold++));
+      }
+    }
+    std::size_t rank =
+        std::lower_bound(cdf.begin(), cdf.end(), dist(rand)) - cdf.begin();
+    trace.push_back(Address(0xc0000000 + rank));
+  }
+  return trace;
+}
+
+template <typename Policy>
+void Run(const char *name, std::size_t capacity,
+         const std::vector<in_addr> &trace) {
+  Table<Policy> table(capacity);
+  std::size_t hits = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (const auto &addr : trace) {
+    hits += table.Access(addr);
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  // Time hits alone on a table holding exactly the accessed addresses.
+  Table<Policy> warm(capacity);
+  std::vector<in_addr> keys;
+  for (std::size_t i = 0; i < capacity; ++i) {
+    keys.push_back(Address(0x0b000000 + i));
+    warm.Access(keys.back());
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+  const std::size_t rounds = std::max<std::size_t>(1, (1 << 22) / capacity);
+  auto hit_start = std::chrono::steady_clock::now();
+  for (std::size_t r = 0; r < rounds; ++r) {
+    for (const auto &addr : keys) {
+      warm.Access(addr);
+    }
+  }
+  std::chrono::duration<double, std::nano> hit_elapsed =
+      std::chrono::steady_clock::now() - hit_start;
+
+  std::cout << std::setw(10) << name << std::setw(12) << std::fixed
+            << std::setprecision(2) << 100.0 * hits / trace.size()
+            << std::setw(14) << elapsed.count() / trace.size()
+            << std::setw(12) << hit_elapsed.count() / (rounds * capacity)
+            << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::size_t capacity =
+      argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1024;
+  if (capacity == 0) {
+    std::cerr << "capacity must be positive." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    std::vector<in_addr> trace = argc > 2
+        ? ReadAddressFile(argv[2], AddressFileFormat::kText)
+        : SyntheticTrace(capacity);
+    if (trace.empty()) {
+      throw std::runtime_error("empty trace.");
+    }
+
+    std::cout << trace.size() << " accesses, capacity " << capacity << "\n"
+              << std::setw(10) << "policy" << std::setw(12) << "hits (%)"
+              << std::setw(14) << "access (ns)" << std::setw(12)
+              << "hit (ns)" << std::endl;
+    Run<LruPolicy>("lru", capacity, trace);
+    Run<ClockPolicy>("clock", capacity, trace);
+    Run<TtlOnlyPolicy>("ttl", capacity, trace);
+    Run<FrequencyPolicy>("frequency", capacity, trace);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
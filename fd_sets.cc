@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fd_sets.h"
+
+#include <cerrno>
+#include <algorithm>
+#include <stdexcept>
+
+namespace ipremapd {
+
+FdSets::FdSets() : max_fd_(-1) {
+  FD_ZERO(&readfds_);
+  FD_ZERO(&writefds_);
+  FD_ZERO(&exceptfds_);
+}
+
+void FdSets::WatchRead(int fd) {
+  Watch(fd, &readfds_);
+}
+
+void FdSets::WatchWrite(int fd) {
+  Watch(fd, &writefds_);
+}
+
+void FdSets::WatchExcept(int fd) {
+  Watch(fd, &exceptfds_);
+}
+
+bool FdSets::Select(timeval *timeout) {
+  errno = 0;
+  if (select(max_fd_ + 1, &readfds_, &writefds_, &exceptfds_, timeout) < 0) {
+    if (errno == EINTR) {
+      FD_ZERO(&readfds_);
+      FD_ZERO(&writefds_);
+      FD_ZERO(&exceptfds_);
+      return false;
+    } else {
+      throw std::runtime_error("select failed.");
+    }
+  }
+  return true;
+}
+
+void FdSets::Watch(int fd, fd_set *set) {
+  if (fd >= FD_SETSIZE) {
+    throw std::runtime_error("file descriptor too large for select.");
+  }
+  FD_SET(fd, set);
+  max_fd_ = std::max(max_fd_, fd);
+}
+
+} // namespace ipremapd
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IPREMAPD_FD_SETS_H_
+#define IPREMAPD_FD_SETS_H_
+
+#include <sys/select.h>
+#include <sys/time.h>
+
+namespace ipremapd {
+
+// The descriptors of every component sharing one select() call.
+class FdSets {
+ public:
+  FdSets();
+
+  void WatchRead(int fd);
+  void WatchWrite(int fd);
+  void WatchExcept(int fd);
+
+  bool readable(int fd) const { return FD_ISSET(fd, &readfds_); }
+  bool writeable(int fd) const { return FD_ISSET(fd, &writefds_); }
+  bool has_exception(int fd) const { return FD_ISSET(fd, &exceptfds_); }
+
+  // Returns false if select was interrupted by a signal.
+  bool Select(timeval *timeout);
+
+ private:
+  void Watch(int fd, fd_set *set);
+
+  fd_set readfds_;
+  fd_set writefds_;
+  fd_set exceptfds_;
+  int max_fd_;
+};
+
+} // namespace ipremapd
+
+#endif // IPREMAPD_FD_SETS_H_
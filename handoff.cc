@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "handoff.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "basic_mapper.h"
+
+#ifndef UNIX_PATH_MAX
+// man 7 unix says UNIX_PATH_MAX should be defined, but it isn't.
+#define UNIX_PATH_MAX sizeof(std::declval<sockaddr_un>().sun_path)
+#endif
+
+namespace ipremapd {
+
+namespace {
+
+const char kMagic[4] = {'I', 'P', 'R', 'H'};
+constexpr std::uint32_t kVersion = 4;
+
+// SCM_RIGHTS messages carry at most SCM_MAX_FD (253) descriptors.
+constexpr std::size_t kMaxFdsPerMessage = 64;
+constexpr std::size_t kMappingsPerMessage = 4096;
+
+// How long the daemon handing over waits for its successor to read the
+// state and confirm, before it resumes serving.
+constexpr time_t kHandoffTimeoutSec = 10;
+
+struct Header {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t connection_count;
+  // Whether the stats socket follows the client socket.
+  std::uint32_t has_stats;
+  std::uint64_t mapping_count;
+};
+
+struct WireConnection {
+  std::uint8_t write_pending;
+  std::uint8_t response_length;
+  std::uint8_t reserved[2];
+  char response[Server::kMaxResponseSize];
+};
+
+struct WireMapping {
+  in_addr orig_addr;
+  in_addr nat_addr;
+  std::uint16_t orig_port;
+  std::uint16_t nat_port;
+  std::uint8_t proto;
+  std::uint8_t reserved[3];
+  std::int64_t age_ms;
+  std::int64_t ttl_ms;
+};
+
+sockaddr_un HandoffAddress(const std::string &path) {
+  if (path.length() >= UNIX_PATH_MAX) {
+    throw std::invalid_argument("path too long.");
+  }
+  sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, path.c_str(), UNIX_PATH_MAX);
+  return sa;
+}
+
+void SendMessage(int fd, const void *data, std::size_t length,
+                 const int *fds = nullptr, std::size_t fd_count = 0) {
+  iovec iov;
+  iov.iov_base = const_cast<void *>(data);
+  iov.iov_len = length;
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  std::vector<char> control;
+  if (fd_count > 0) {
+    control.resize(CMSG_SPACE(sizeof(int) * fd_count));
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+  }
+  ssize_t res;
+  do {
+    errno = 0;
+    res = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  } while (res < 0 && errno == EINTR);
+  if (res != static_cast<ssize_t>(length)) {
+    throw std::runtime_error("sendmsg failed.");
+  }
+}
+
+// Returns the number of bytes received; received descriptors are appended
+// to fds.
+std::size_t ReceiveMessage(int fd, void *data, std::size_t length,
+                           std::vector<int> &fds) {
+  iovec iov;
+  iov.iov_base = data;
+  iov.iov_len = length;
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * kMaxFdsPerMessage));
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  ssize_t res;
+  do {
+    errno = 0;
+    res = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (res < 0 && errno == EINTR);
+  if (res <= 0) {
+    throw std::runtime_error("recvmsg failed.");
+  }
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      std::size_t offset = fds.size();
+      fds.resize(offset + count);
+      memcpy(fds.data() + offset, CMSG_DATA(cmsg), sizeof(int) * count);
+    }
+  }
+  if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0) {
+    throw std::runtime_error("handoff message truncated.");
+  }
+  return static_cast<std::size_t>(res);
+}
+
+} // namespace
+
+HandoffListener::HandoffListener(const std::string &path) : path_(path) {
+  sockaddr_un sa = HandoffAddress(path);
+  socket_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+  if (socket_fd_ < 0) {
+    throw std::runtime_error("socket failed.");
+  }
+  // A successor binds while its predecessor is still around.
+  unlink(path.c_str());
+  if (bind(socket_fd_, reinterpret_cast<const sockaddr *>(&sa),
+           sizeof(sa)) < 0) {
+    close(socket_fd_);
+    throw std::runtime_error("bind failed.");
+  }
+  if (listen(socket_fd_, 1) < 0) {
+    close(socket_fd_);
+    unlink(path.c_str());
+    throw std::runtime_error("listen failed.");
+  }
+}
+
+HandoffListener::~HandoffListener() {
+  close(socket_fd_);
+  if (!path_.empty()) {
+    unlink(path_.c_str());
+  }
+}
+
+void HandoffListener::Prepare(FdSets &fds) const {
+  fds.WatchRead(socket_fd_);
+}
+
+int HandoffListener::Dispatch(const FdSets &fds) {
+  if (!fds.readable(socket_fd_)) {
+    return -1;
+  }
+  errno = 0;
+  // The handoff itself is done with blocking calls.
+  int fd = accept4(socket_fd_, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+      && errno != ECONNABORTED) {
+    throw std::runtime_error("accept failed.");
+  }
+  return fd;
+}
+
+bool HandOff(int successor_fd, const Server &server, const StatsServer *stats,
+             const Mapper &mapper) {
+  const std::vector<Server::ConnectionState> connections =
+      server.connection_states();
+
+  // A hung successor must not leave this daemon stuck with its clients.
+  const timeval timeout = {kHandoffTimeoutSec, 0};
+  if (setsockopt(successor_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                 sizeof(timeout)) < 0
+      || setsockopt(successor_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                    sizeof(timeout)) < 0) {
+    close(successor_fd);
+    return false;
+  }
+
+  try {
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.connection_count = static_cast<std::uint32_t>(connections.size());
+    header.has_stats = stats != nullptr;
+    header.mapping_count = mapper.mapped_count();
+    const int socket_fds[] = {server.socket_fd(),
+                              stats != nullptr ? stats->socket_fd() : -1};
+    SendMessage(successor_fd, &header, sizeof(header), socket_fds,
+                header.has_stats + 1);
+
+    for (std::size_t i = 0; i < connections.size();
+         i += kMaxFdsPerMessage) {
+      std::size_t count = std::min(kMaxFdsPerMessage, connections.size() - i);
+      std::vector<WireConnection> wire(count);
+      std::vector<int> fds(count);
+      for (std::size_t j = 0; j < count; ++j) {
+        const auto &state = connections[i + j];
+        memset(&wire[j], 0, sizeof(wire[j]));
+        wire[j].write_pending = state.write_pending ? 1 : 0;
+        wire[j].response_length =
+            static_cast<std::uint8_t>(state.response.size());
+        memcpy(wire[j].response, state.response.data(),
+               state.response.size());
+        fds[j] = state.fd;
+      }
+      SendMessage(successor_fd, wire.data(),
+                  sizeof(WireConnection) * count, fds.data(), count);
+    }
+
+    const auto now = std::chrono::system_clock::now();
+    std::vector<WireMapping> wire;
+    wire.reserve(kMappingsPerMessage);
+    auto flush = [&]() {
+      if (!wire.empty()) {
+        SendMessage(successor_fd, wire.data(),
+                    sizeof(WireMapping) * wire.size());
+        wire.clear();
+      }
+    };
+    mapper.ForEachMapping(
+        [&](const Endpoint &orig, const Endpoint &nat,
+            std::chrono::system_clock::time_point last_access,
+            std::chrono::system_clock::duration ttl) {
+          WireMapping mapping;
+          memset(&mapping, 0, sizeof(mapping));
+          mapping.orig_addr = orig.addr;
+          mapping.nat_addr = nat.addr;
+          mapping.orig_port = orig.port;
+          mapping.nat_port = nat.port;
+          mapping.proto = orig.proto;
+          mapping.age_ms = std::chrono::duration_cast<
+            std::chrono::milliseconds>(now - last_access).count();
+          mapping.ttl_ms = std::chrono::duration_cast<
+            std::chrono::milliseconds>(ttl).count();
+          wire.push_back(mapping);
+          if (wire.size() == kMappingsPerMessage) {
+            flush();
+          }
+        });
+    flush();
+
+    char ack;
+    ssize_t res;
+    do {
+      errno = 0;
+      res = read(successor_fd, &ack, sizeof(ack));
+    } while (res < 0 && errno == EINTR);
+    close(successor_fd);
+    return res == sizeof(ack);
+  } catch (std::runtime_error &) {
+    close(successor_fd);
+    return false;
+  }
+}
+
+int ConnectForTakeover(const std::string &path) {
+  sockaddr_un sa = HandoffAddress(path);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw std::runtime_error("socket failed.");
+  }
+  if (connect(fd, reinterpret_cast<const sockaddr *>(&sa), sizeof(sa)) < 0) {
+    close(fd);
+    throw std::runtime_error("cannot connect to the running daemon.");
+  }
+  return fd;
+}
+
+HandoffState ReceiveState(int fd) {
+  HandoffState state;
+  std::vector<int> fds;
+  try {
+    Header header;
+    if (ReceiveMessage(fd, &header, sizeof(header), fds) != sizeof(header)
+        || memcmp(header.magic, kMagic, sizeof(kMagic)) != 0
+        || header.version != kVersion || header.has_stats > 1
+        || fds.size() != header.has_stats + 1) {
+      throw std::runtime_error("invalid handoff header.");
+    }
+    state.stats_fd = header.has_stats != 0 ? fds[1] : -1;
+
+    std::vector<WireConnection> wire_connections(kMaxFdsPerMessage);
+    std::size_t offset = fds.size();
+    while (state.connections.size() < header.connection_count) {
+      std::size_t length = ReceiveMessage(
+          fd, wire_connections.data(),
+          sizeof(WireConnection) * wire_connections.size(), fds);
+      std::size_t count = length / sizeof(WireConnection);
+      if (fds.size() != offset + count) {
+        throw std::runtime_error("connection descriptors missing.");
+      }
+      for (std::size_t i = 0; i < count; ++i) {
+        const auto &wire = wire_connections[i];
+        if (wire.response_length > sizeof(wire.response)) {
+          throw std::runtime_error("invalid connection state.");
+        }
+        state.connections.push_back({
+            fds[offset + i], wire.write_pending != 0,
+            std::string(wire.response, wire.response_length)});
+      }
+      offset += count;
+    }
+
+    const auto now = std::chrono::system_clock::now();
+    std::vector<WireMapping> wire_mappings(kMappingsPerMessage);
+    state.mappings.reserve(header.mapping_count);
+    while (state.mappings.size() < header.mapping_count) {
+      std::size_t length = ReceiveMessage(
+          fd, wire_mappings.data(),
+          sizeof(WireMapping) * wire_mappings.size(), fds);
+      std::size_t count = length / sizeof(WireMapping);
+      for (std::size_t i = 0; i < count; ++i) {
+        const WireMapping &wire = wire_mappings[i];
+        state.mappings.push_back({
+            Endpoint(wire.orig_addr, wire.orig_port, wire.proto),
+            Endpoint(wire.nat_addr, wire.nat_port, wire.proto),
+            now - std::chrono::milliseconds(wire.age_ms),
+            std::chrono::milliseconds(wire.ttl_ms)});
+      }
+    }
+  } catch (...) {
+    for (int received : fds) {
+      close(received);
+    }
+    throw;
+  }
+  state.socket_fd = fds[0];
+  return state;
+}
+
+void ConfirmTakeover(int fd) {
+  const char ack = 0;
+  // Fails rather than raising SIGPIPE if the predecessor gave up waiting.
+  if (send(fd, &ack, sizeof(ack), MSG_NOSIGNAL) != sizeof(ack)) {
+    throw std::runtime_error("cannot confirm takeover.");
+  }
+}
+
+} // namespace ipremapd
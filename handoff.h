@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IPREMAPD_HANDOFF_H_
+#define IPREMAPD_HANDOFF_H_
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "fd_sets.h"
+#include "mapper.h"
+#include "server.h"
+#include "stats.h"
+
+namespace ipremapd {
+
+// Listens for a newly started daemon asking to take over.
+class HandoffListener {
+ public:
+  explicit HandoffListener(const std::string &path);
+  HandoffListener(const HandoffListener &) = delete;
+  HandoffListener &operator=(const HandoffListener &) = delete;
+  ~HandoffListener();
+
+  void Prepare(FdSets &fds) const;
+  // Returns the connection to the successor, or -1 if there is none yet.
+  int Dispatch(const FdSets &fds);
+  // Leaves the socket path in place for the successor.
+  void Release() { path_.clear(); }
+
+ private:
+  std::string path_;
+  int socket_fd_;
+};
+
+struct HandoffState {
+  struct MappingState {
+    Endpoint orig;
+    Endpoint nat;
+    std::chrono::system_clock::time_point last_access;
+    std::chrono::system_clock::duration ttl;
+  };
+
+  int socket_fd;
+  // -1 if the predecessor had no stats socket.
+  int stats_fd;
+  std::vector<Server::ConnectionState> connections;
+  std::vector<MappingState> mappings;
+};
+
+// Passes the listening sockets, the client connections and the mapping
+// table to the successor. stats may be null. Returns whether the successor
+// confirmed the takeover in time; the caller may resume serving otherwise.
+bool HandOff(int successor_fd, const Server &server, const StatsServer *stats,
+             const Mapper &mapper);
+
+// Connects to the running daemon and receives its state. The takeover is
+// complete once ConfirmTakeover() is called on the returned descriptor.
+int ConnectForTakeover(const std::string &path);
+HandoffState ReceiveState(int fd);
+void ConfirmTakeover(int fd);
+
+} // namespace ipremapd
+
+#endif // IPREMAPD_HANDOFF_H_
@@ -22,28 +22,235 @@
 #include <string.h>
 
 #include <unistd.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include "protocol.h"
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-t seconds] [-r | -d] [-u] "
+          "<address>[:<port>]\n"
+          "       %s -s <stats socket> [-o | -n] [<address>/<length>]\n"
+          "       %s -s <stats socket> -x [-u] <address>[:<port>]\n"
+          "  -t  lease the mapping for the given time-to-live\n"
+          "  -r  renew the lease of an existing mapping\n"
+          "  -d  release the mapping\n"
+          "  -u  map a UDP rather than a TCP port\n"
+          "  -s  list the mappings through the stats socket of ipremapd\n"
+          "  -o  list those with original addresses in the prefix\n"
+          "  -n  list those with NAT addresses in the prefix\n"
+          "  -x  look up the mapping to a NAT address\n",
+          argv0, argv0, argv0);
+}
+
+static int connect_to(const char *path) {
+  struct sockaddr_un sa;
+  int fd;
+
+  if (strlen(path) >= sizeof(sa.sun_path)) {
+    fprintf(stderr, "path too long: %s\n", path);
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd < 0) {
+    perror("socket()");
+    return -1;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+  if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+    perror("connect()");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void print_endpoint(struct in_addr addr, uint16_t port) {
+  char buf[INET_ADDRSTRLEN];
+
+  inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
+  if (port != 0) {
+    printf("%s:%u", buf, (unsigned) ntohs(port));
+  } else {
+    printf("%s", buf);
+  }
+}
+
+/* Prints the mappings answering request, which may span many messages. */
+static int stats(const char *path,
+                 const struct ipremap_stats_request *request) {
+  static char buf[sizeof(struct ipremap_stats_header)
+                  + 65535 * sizeof(struct ipremap_mapping)];
+  struct ipremap_stats_header header;
+  struct ipremap_mapping mapping;
+  ssize_t res;
+  size_t i, count;
+  int fd, ret = EXIT_FAILURE;
+
+  fd = connect_to(path);
+  if (fd < 0) {
+    return EXIT_FAILURE;
+  }
+  if (write(fd, request, sizeof(*request)) != sizeof(*request)) {
+    perror("write()");
+    goto out;
+  }
+  do {
+    res = read(fd, buf, sizeof(buf));
+    if (res < (ssize_t) sizeof(header)) {
+      perror("read()");
+      goto out;
+    }
+    memcpy(&header, buf, sizeof(header));
+    count = ntohs(header.count);
+    if (header.status == IPREMAP_NOT_MAPPED) {
+      fprintf(stderr, "not mapped\n");
+      goto out;
+    } else if (header.status != IPREMAP_OK
+               || (size_t) res != sizeof(header) + count * sizeof(mapping)) {
+      fprintf(stderr, "request failed\n");
+      goto out;
+    }
+    for (i = 0; i < count; ++i) {
+      memcpy(&mapping, buf + sizeof(header) + i * sizeof(mapping),
+             sizeof(mapping));
+      print_endpoint(mapping.orig_addr, mapping.orig_port);
+      printf(" ");
+      print_endpoint(mapping.nat_addr, mapping.nat_port);
+      if (mapping.proto == IPPROTO_UDP) {
+        printf(" udp");
+      } else if (mapping.proto == IPPROTO_TCP) {
+        printf(" tcp");
+      }
+      printf(" %lu %lu\n", (unsigned long) ntohl(mapping.age),
+             (unsigned long) ntohl(mapping.ttl));
+    }
+  } while (header.more);
+  ret = EXIT_SUCCESS;
+
+out:
+  close(fd);
+  return ret;
+}
+
 int main(int argc, char *argv[]) {
-  int ret = EXIT_FAILURE, res, fd;
+  int ret = EXIT_FAILURE, res, fd, opt, lease = 0;
   struct sockaddr_un sa;
   struct in_addr orig_addr, nat_addr;
-  char buf[INET_ADDRSTRLEN];
+  struct ipremap_request request;
+  struct ipremap_response response;
+  struct ipremap_port_request port_request;
+  struct ipremap_port_response port_response;
+  unsigned long orig_port = 0;
+  uint8_t proto = IPPROTO_TCP;
+  char buf[INET_ADDRSTRLEN], addr_str[INET_ADDRSTRLEN], *colon, *end;
+  const char *stats_path = NULL;
+  struct ipremap_stats_request stats_request;
+  unsigned long prefix_len = 32;
 
-  if (argc < 2) {
-    fprintf(stderr, "usage: %s <address>\n", argv[0]);
+  memset(&request, 0, sizeof(request));
+  request.op = IPREMAP_MAP;
+  memset(&stats_request, 0, sizeof(stats_request));
+  stats_request.op = IPREMAP_DUMP;
+  while ((opt = getopt(argc, argv, "t:rdus:onx")) != -1) {
+    switch (opt) {
+      case 't':
+        request.ttl = htonl((uint32_t) strtoul(optarg, NULL, 10));
+        lease = 1;
+        break;
+      case 'r':
+        request.op = IPREMAP_RENEW;
+        lease = 1;
+        break;
+      case 'd':
+        request.op = IPREMAP_RELEASE;
+        lease = 1;
+        break;
+      case 'u':
+        proto = IPPROTO_UDP;
+        break;
+      case 's':
+        stats_path = optarg;
+        break;
+      case 'o':
+        stats_request.filter = IPREMAP_FILTER_ORIG;
+        break;
+      case 'n':
+        stats_request.filter = IPREMAP_FILTER_NAT;
+        break;
+      case 'x':
+        stats_request.op = IPREMAP_LOOKUP;
+        break;
+      default:
+        usage(argv[0]);
+        goto out1;
+    }
+  }
+  if (stats_path != NULL && stats_request.op == IPREMAP_DUMP) {
+    if (optind == argc && stats_request.filter == IPREMAP_FILTER_NONE) {
+      return stats(stats_path, &stats_request);
+    }
+    if (optind + 1 != argc || stats_request.filter == IPREMAP_FILTER_NONE) {
+      usage(argv[0]);
+      goto out1;
+    }
+    colon = strchr(argv[optind], '/');
+    if (colon != NULL) {
+      prefix_len = strtoul(colon + 1, &end, 10);
+      *colon = '\0';
+      if (colon[1] == '\0' || *end != '\0' || prefix_len > 32) {
+        fprintf(stderr, "invalid prefix length\n");
+        goto out1;
+      }
+    }
+    if (inet_pton(AF_INET, argv[optind], &stats_request.addr) <= 0) {
+      fprintf(stderr, "invalid address: %s\n", argv[optind]);
+      goto out1;
+    }
+    stats_request.prefix_len = (uint8_t) prefix_len;
+    return stats(stats_path, &stats_request);
+  }
+  if (optind + 1 != argc) {
+    usage(argv[0]);
+    goto out1;
+  }
+  colon = strchr(argv[optind], ':');
+  if (colon != NULL) {
+    orig_port = strtoul(colon + 1, &end, 10);
+    if ((size_t) (colon - argv[optind]) >= sizeof(addr_str)
+        || colon[1] == '\0' || *end != '\0'
+        || orig_port == 0 || orig_port > 65535) {
+      fprintf(stderr, "invalid address: %s\n", argv[optind]);
+      goto out1;
+    }
+    memcpy(addr_str, argv[optind], (size_t) (colon - argv[optind]));
+    addr_str[colon - argv[optind]] = '\0';
+  } else if (strlen(argv[optind]) < sizeof(addr_str)) {
+    strcpy(addr_str, argv[optind]);
+  } else {
+    fprintf(stderr, "invalid address: %s\n", argv[optind]);
     goto out1;
   }
-  res = inet_pton(AF_INET, argv[1], &orig_addr);
+  res = inet_pton(AF_INET, addr_str, &orig_addr);
   if (res < 0) {
     perror("inet_pton()");
     goto out1;
   } else if (res == 0) {
-    fprintf(stderr, "invalid address: %s\n", argv[1]);
+    fprintf(stderr, "invalid address: %s\n", argv[optind]);
     goto out1;
   }
+  if (stats_path != NULL) {
+    stats_request.addr = orig_addr;
+    if (orig_port != 0) {
+      stats_request.proto = proto;
+      stats_request.port = htons((uint16_t) orig_port);
+    }
+    return stats(stats_path, &stats_request);
+  }
   fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
   if (fd < 0) {
     perror("socket()");
@@ -56,19 +263,75 @@ int main(int argc, char *argv[]) {
     perror("connect()");
     goto out2;
   }
-  if (write(fd, &orig_addr, sizeof(orig_addr)) != sizeof(orig_addr)) {
-    perror("write()");
-    goto out2;
+  if (orig_port != 0) {
+    memset(&port_request, 0, sizeof(port_request));
+    port_request.op = request.op;
+    port_request.proto = proto;
+    port_request.ttl = request.ttl;
+    port_request.addr = orig_addr;
+    port_request.port = htons((uint16_t) orig_port);
+    if (write(fd, &port_request, sizeof(port_request))
+        != sizeof(port_request)) {
+      perror("write()");
+      goto out2;
+    }
+    if (read(fd, &port_response, sizeof(port_response))
+        != sizeof(port_response)) {
+      perror("read()");
+      goto out2;
+    }
+    response.status = port_response.status;
+    response.ttl = port_response.ttl;
+    response.addr = port_response.addr;
+  } else if (lease) {
+    request.addr = orig_addr;
+    if (write(fd, &request, sizeof(request)) != sizeof(request)) {
+      perror("write()");
+      goto out2;
+    }
+    if (read(fd, &response, sizeof(response)) != sizeof(response)) {
+      perror("read()");
+      goto out2;
+    }
+  } else {
+    if (write(fd, &orig_addr, sizeof(orig_addr)) != sizeof(orig_addr)) {
+      perror("write()");
+      goto out2;
+    }
+    if (read(fd, &nat_addr, sizeof(nat_addr)) != sizeof(nat_addr)) {
+      perror("read()");
+      goto out2;
+    }
   }
-  if (read(fd, &nat_addr, sizeof(nat_addr)) != sizeof(nat_addr)) {
-    perror("read()");
-    goto out2;
+  if (orig_port != 0 || lease) {
+    if (response.status == IPREMAP_NOT_MAPPED) {
+      fprintf(stderr, "not mapped: %s\n", argv[optind]);
+      goto out2;
+    } else if (response.status != IPREMAP_OK) {
+      fprintf(stderr, "request failed\n");
+      goto out2;
+    }
+    if (request.op == IPREMAP_RELEASE) {
+      ret = EXIT_SUCCESS;
+      goto out2;
+    }
+    nat_addr = response.addr;
   }
   if (inet_ntop(AF_INET, &nat_addr, buf, INET_ADDRSTRLEN) == NULL) {
     perror("inet_ntop()");
     goto out2;
   }
-  printf("%s\n", buf);
+  if (orig_port != 0) {
+    printf("%s:%u", buf, (unsigned) ntohs(port_response.port));
+    if (lease) {
+      printf(" %lu", (unsigned long) ntohl(response.ttl));
+    }
+    printf("\n");
+  } else if (lease) {
+    printf("%s %lu\n", buf, (unsigned long) ntohl(response.ttl));
+  } else {
+    printf("%s\n", buf);
+  }
   ret = EXIT_SUCCESS;
 
 out2:
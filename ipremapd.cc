@@ -17,15 +17,28 @@
  * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstdlib>
 #include <stdexcept>
 #include <iostream>
+#include <memory>
+#include <string>
 
+#include <getopt.h>
 #include <signal.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 
+#include "fd_sets.h"
+#include "handoff.h"
+#include "basic_mapper.h"
 #include "remap_chain.h"
 #include "mapper.h"
+#include "preload.h"
+#include "replication.h"
 #include "server.h"
+#include "spawner.h"
+#include "stats.h"
+#include "trace.h"
 
 namespace ipremapd {
 
@@ -45,31 +58,496 @@ static in_addr StringToAddress(const std::string &str) {
   return addr;
 }
 
-} // namespace ipremapd
+struct Options {
+  std::string chain = "ipremap";
+  std::string socket_path = "ipremap.sock";
+  NatPool pool = {StringToAddress("10.19.0.0"),
+                  StringToAddress("255.255.0.0"), 0, 0};
+  std::size_t max_size = 32;
+  std::chrono::seconds ttl = std::chrono::minutes(5);
+  std::chrono::seconds max_ttl = std::chrono::minutes(5);
+  std::string replication_listen;
+  std::string replicate_from;
+  std::string handoff;
+  std::string takeover;
+  std::string preload;
+  AddressFileFormat preload_format = AddressFileFormat::kText;
+  EvictionPolicy eviction = EvictionPolicy::kLru;
+  // Percentages of max_size, zero high disables background eviction.
+  unsigned long low_watermark = 0;
+  unsigned long high_watermark = 0;
+  std::string trace;
+  std::string stats;
+  // Zero disables reordering the chain.
+  std::chrono::seconds reorder_interval = std::chrono::seconds::zero();
+};
 
-int main() {
-  using namespace ipremapd;
+enum LongOption {
+  kMaxTtl = 256,
+  kReplicationListen,
+  kReplicateFrom,
+  kHandoff,
+  kTakeover,
+  kPreload,
+  kPreloadBinary,
+  kEviction,
+  kPorts,
+  kWatermarks,
+  kTrace,
+  kStats,
+  kReorder
+};
 
+static void Usage(const char *argv0) {
+  std::cerr << "usage: " << argv0 << " [options]\n"
+      "  -c, --chain=NAME           iptables nat chain (default: ipremap)\n"
+      "  -s, --socket=PATH          client socket (default: ipremap.sock)\n"
+      "  -r, --range=ADDR/LEN       NAT address range (default: 10.19.0.0/16)\n"
+      "  -n, --max-size=COUNT       maximum number of mappings (default: 32)\n"
+      "  -t, --ttl=SECONDS          mapping time-to-live, 0 is forever\n"
+      "                             (default: 300)\n"
+      "      --max-ttl=SECONDS      longest lease clients may request, 0 is\n"
+      "                             unlimited (default: 300)\n"
+      "      --replication-listen=SPEC\n"
+      "                             stream mapping changes to replicas\n"
+      "      --replicate-from=SPEC  follow a primary and take over when it\n"
+      "                             goes away\n"
+      "      --handoff=PATH         let a new daemon take over through PATH\n"
+      "      --takeover=PATH        take over from the daemon listening on\n"
+      "                             PATH without disturbing its clients\n"
+      "      --preload=FILE         map the addresses listed in FILE before\n"
+      "                             accepting clients\n"
+      "      --preload-binary=FILE  like --preload, but FILE holds packed\n"
+      "                             4-byte addresses in network byte order\n"
+      "      --eviction=POLICY      lru, clock, ttl or frequency\n"
+      "                             (default: lru)\n"
+      "      --ports=FIRST-LAST     map ports instead of whole addresses,\n"
+      "                             using NAT ports FIRST to LAST\n"
+      "      --watermarks=LOW,HIGH  evict in the background down to LOW\n"
+      "                             percent of max-size once the table is\n"
+      "                             HIGH percent full\n"
+      "      --trace=FILE           record client requests to FILE for\n"
+      "                             trace_replay\n"
+      "      --stats=PATH           answer table dumps and reverse lookups\n"
+      "                             on PATH\n"
+      "      --reorder=SECONDS      move the busiest rules to the top of the\n"
+      "                             chain every SECONDS (default: 0, never)\n"
+      "SPEC is either a Unix socket path or host:port.\n";
+}
+
+static void ParseRange(const std::string &str, Options &options) {
+  std::size_t slash = str.find('/');
+  if (slash == std::string::npos) {
+    throw std::invalid_argument("range must be given as ADDR/LEN.");
+  }
+  int len = std::stoi(str.substr(slash + 1));
+  if (len < 0 || len > 32) {
+    throw std::invalid_argument("invalid prefix length.");
+  }
+  options.pool.range = StringToAddress(str.substr(0, slash));
+  options.pool.mask.s_addr =
+      htonl(len == 0 ? 0 : ~static_cast<std::uint32_t>(0) << (32 - len));
+}
+
+static void ParsePorts(const std::string &str, Options &options) {
+  std::size_t dash = str.find('-');
+  if (dash == std::string::npos) {
+    throw std::invalid_argument("ports must be given as FIRST-LAST.");
+  }
+  unsigned long first = std::stoul(str.substr(0, dash));
+  unsigned long last = std::stoul(str.substr(dash + 1));
+  if (first == 0 || last > 65535 || last < first) {
+    throw std::invalid_argument("invalid port range.");
+  }
+  options.pool.first_port = static_cast<std::uint16_t>(first);
+  options.pool.last_port = static_cast<std::uint16_t>(last);
+}
+
+static void ParseWatermarks(const std::string &str, Options &options) {
+  std::size_t comma = str.find(',');
+  if (comma == std::string::npos) {
+    throw std::invalid_argument("watermarks must be given as LOW,HIGH.");
+  }
+  options.low_watermark = std::stoul(str.substr(0, comma));
+  options.high_watermark = std::stoul(str.substr(comma + 1));
+  if (options.high_watermark > 100
+      || options.low_watermark > options.high_watermark) {
+    throw std::invalid_argument("invalid watermarks.");
+  }
+}
+
+static EvictionPolicy ParseEviction(const std::string &str) {
+  if (str == "lru") {
+    return EvictionPolicy::kLru;
+  } else if (str == "clock") {
+    return EvictionPolicy::kClock;
+  } else if (str == "ttl") {
+    return EvictionPolicy::kTtlOnly;
+  } else if (str == "frequency") {
+    return EvictionPolicy::kFrequency;
+  }
+  throw std::invalid_argument("unknown eviction policy.");
+}
+
+static Options ParseOptions(int argc, char *argv[]) {
+  static const option long_options[] = {
+    {"chain", required_argument, nullptr, 'c'},
+    {"socket", required_argument, nullptr, 's'},
+    {"range", required_argument, nullptr, 'r'},
+    {"max-size", required_argument, nullptr, 'n'},
+    {"ttl", required_argument, nullptr, 't'},
+    {"max-ttl", required_argument, nullptr, kMaxTtl},
+    {"replication-listen", required_argument, nullptr, kReplicationListen},
+    {"replicate-from", required_argument, nullptr, kReplicateFrom},
+    {"handoff", required_argument, nullptr, kHandoff},
+    {"takeover", required_argument, nullptr, kTakeover},
+    {"preload", required_argument, nullptr, kPreload},
+    {"preload-binary", required_argument, nullptr, kPreloadBinary},
+    {"eviction", required_argument, nullptr, kEviction},
+    {"ports", required_argument, nullptr, kPorts},
+    {"watermarks", required_argument, nullptr, kWatermarks},
+    {"trace", required_argument, nullptr, kTrace},
+    {"stats", required_argument, nullptr, kStats},
+    {"reorder", required_argument, nullptr, kReorder},
+    {"help", no_argument, nullptr, 'h'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  Options options;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:s:r:n:t:h", long_options,
+                            nullptr)) != -1) {
+    switch (opt) {
+      case 'c':
+        options.chain = optarg;
+        break;
+      case 's':
+        options.socket_path = optarg;
+        break;
+      case 'r':
+        ParseRange(optarg, options);
+        break;
+      case 'n':
+        options.max_size = std::stoul(optarg);
+        break;
+      case 't':
+        options.ttl = std::chrono::seconds(std::stoul(optarg));
+        break;
+      case kMaxTtl:
+        options.max_ttl = std::chrono::seconds(std::stoul(optarg));
+        break;
+      case kReplicationListen:
+        options.replication_listen = optarg;
+        break;
+      case kReplicateFrom:
+        options.replicate_from = optarg;
+        break;
+      case kHandoff:
+        options.handoff = optarg;
+        break;
+      case kTakeover:
+        options.takeover = optarg;
+        break;
+      case kPreload:
+        options.preload = optarg;
+        options.preload_format = AddressFileFormat::kText;
+        break;
+      case kPreloadBinary:
+        options.preload = optarg;
+        options.preload_format = AddressFileFormat::kBinary;
+        break;
+      case kEviction:
+        options.eviction = ParseEviction(optarg);
+        break;
+      case kPorts:
+        ParsePorts(optarg, options);
+        break;
+      case kWatermarks:
+        ParseWatermarks(optarg, options);
+        break;
+      case kTrace:
+        options.trace = optarg;
+        break;
+      case kStats:
+        options.stats = optarg;
+        break;
+      case kReorder:
+        options.reorder_interval = std::chrono::seconds(std::stoul(optarg));
+        break;
+      case 'h':
+        Usage(argv[0]);
+        exit(EXIT_SUCCESS);
+      default:
+        Usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (optind != argc) {
+    Usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (!options.takeover.empty() && !options.replicate_from.empty()) {
+    throw std::invalid_argument(
+        "cannot take over and replicate at the same time.");
+  }
+  if (!options.preload.empty()
+      && (!options.takeover.empty() || !options.replicate_from.empty())) {
+    throw std::invalid_argument(
+        "preloading conflicts with taking over or replicating.");
+  }
+  if (!options.preload.empty() && options.pool.port_mode()) {
+    throw std::invalid_argument("cannot preload addresses when mapping ports.");
+  }
+  return options;
+}
+
+// Runs as a standby until the primary goes away.
+static void FollowPrimary(const std::shared_ptr<Mapper> &mapper,
+                          const std::string &primary_spec) {
+  ReplicationReplica replica(mapper, primary_spec);
+  auto last_tick = std::chrono::steady_clock::now();
+  while (!interrupted && !replica.primary_lost()) {
+    FdSets fds;
+    replica.Prepare(fds);
+    timeval timeout = {1, 0};
+    if (fds.Select(&timeout)) {
+      replica.Dispatch(fds);
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_tick >= std::chrono::seconds(1)) {
+      replica.Tick();
+      last_tick = now;
+    }
+  }
+  if (!interrupted) {
+    std::clog << "taking over from primary with " << mapper->mapped_count()
+              << " mappings." << std::endl;
+  }
+}
+
+// Installs the rules before clients can connect, so that their first
+// requests do not wait for iptables.
+static void Preload(Mapper &mapper, const std::string &path,
+                    AddressFileFormat format) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<in_addr> addrs = ReadAddressFile(path, format);
+  std::size_t count = mapper.Preload(addrs);
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::clog << "preloaded " << count << " of " << addrs.size()
+            << " addresses in " << elapsed.count() << " ms." << std::endl;
+}
+
+// Adopts the state of the daemon listening on options.takeover. Everything
+// that can fail is set up before the takeover is confirmed, so that the
+// predecessor resumes serving instead.
+template <typename Policy>
+static void TakeOver(const Options &options,
+                     const std::shared_ptr<Spawner> &spawner,
+                     std::shared_ptr<BasicMapper<Policy>> &mapper,
+                     std::shared_ptr<Server> &server,
+                     std::unique_ptr<StatsServer> &stats) {
+  int fd = ConnectForTakeover(options.takeover);
   try {
-    in_addr range = StringToAddress("10.19.0.0");
-    in_addr mask = StringToAddress("255.255.0.0");
+    HandoffState state = ReceiveState(fd);
+    mapper = std::make_shared<BasicMapper<Policy>>(
+        Mapper::adopt_chain, RemapChain(options.chain, spawner), options.pool,
+        options.max_size, options.ttl);
+    if (state.mappings.size() > mapper->max_size()) {
+      throw std::runtime_error("predecessor has more mappings than max-size.");
+    }
+    for (const auto &mapping : state.mappings) {
+      mapper->Adopt(mapping.orig, mapping.nat, mapping.last_access,
+                    mapping.ttl);
+    }
+    server = std::make_shared<Server>(options.socket_path, state.socket_fd,
+                                      state.connections);
+    if (options.stats.empty()) {
+      if (state.stats_fd >= 0) {
+        close(state.stats_fd);
+      }
+    } else if (state.stats_fd >= 0) {
+      stats.reset(new StatsServer(mapper, options.stats, state.stats_fd));
+    } else {
+      stats.reset(new StatsServer(mapper, options.stats));
+    }
+    ConfirmTakeover(fd);
+    std::clog << "took over " << state.mappings.size() << " mappings and "
+              << state.connections.size() << " connections." << std::endl;
+  } catch (...) {
+    // The predecessor keeps serving, so leave its socket and chain alone.
+    if (server) {
+      server->Release();
+    }
+    if (stats) {
+      stats->Release();
+    }
+    if (mapper) {
+      mapper->Release();
+    }
+    close(fd);
+    throw;
+  }
+  close(fd);
+}
 
-    auto mapper = std::make_shared<Mapper>(RemapChain("ipremap"),
-                                           range, mask, 32,
-                                           std::chrono::minutes(5));
-    auto server = std::make_shared<Server>(mapper, "ipremap.sock");
+// Serves requests on the mapper type picked by options.eviction.
+template <typename Policy>
+struct Daemon {
+  static int Run(const Options &options,
+                 const std::shared_ptr<Spawner> &spawner) {
+    std::shared_ptr<BasicMapper<Policy>> mapper;
+    std::shared_ptr<Server> server;
+    std::unique_ptr<StatsServer> stats;
+    if (!options.takeover.empty()) {
+      TakeOver(options, spawner, mapper, server, stats);
+    } else {
+      mapper = std::make_shared<BasicMapper<Policy>>(
+          RemapChain(options.chain, spawner), options.pool, options.max_size,
+          options.ttl);
+      if (!options.replicate_from.empty()) {
+        FollowPrimary(mapper, options.replicate_from);
+        if (interrupted) {
+          return EXIT_SUCCESS;
+        }
+      }
+      if (!options.preload.empty()) {
+        Preload(*mapper, options.preload, options.preload_format);
+      }
+      server = std::make_shared<Server>(options.socket_path);
+    }
 
-    signal(SIGINT, HandleSigint);
+    mapper->set_max_ttl(options.max_ttl);
+    // Of the effective size, which -n 0 derives from the pool.
+    mapper->set_watermarks(mapper->max_size() * options.low_watermark / 100,
+                           mapper->max_size() * options.high_watermark / 100);
+
+    std::shared_ptr<TraceWriter> trace;
+    if (!options.trace.empty()) {
+      trace = std::make_shared<TraceWriter>(options.trace);
+      server->set_trace(trace);
+    }
 
+    if (!options.stats.empty() && !stats) {
+      stats.reset(new StatsServer(mapper, options.stats));
+    }
+
+    std::unique_ptr<ReplicationPrimary> primary;
+    if (!options.replication_listen.empty()) {
+      primary.reset(new ReplicationPrimary(mapper,
+                                           options.replication_listen));
+    }
+    std::unique_ptr<HandoffListener> handoff;
+    if (!options.handoff.empty()) {
+      handoff.reset(new HandoffListener(options.handoff));
+    }
+    int successor_fd = -1;
+
+    auto last_tick = std::chrono::steady_clock::now();
+    auto last_reorder = last_tick;
     while (!interrupted) {
+      FdSets fds;
+      server->Prepare(fds);
+      if (stats) {
+        stats->Prepare(fds);
+      }
+      if (primary) {
+        primary->Prepare(fds);
+      }
+      if (handoff && successor_fd < 0) {
+        handoff->Prepare(fds);
+      }
       timeval timeout = {1, 0};
-      server->Select(&timeout);
-      mapper->Idle();
+      if (fds.Select(&timeout)) {
+        server->Dispatch(*mapper, fds);
+        if (stats) {
+          stats->Dispatch(fds);
+        }
+        if (primary) {
+          primary->Dispatch(fds);
+        }
+        if (handoff && successor_fd < 0) {
+          successor_fd = handoff->Dispatch(fds);
+          if (successor_fd >= 0) {
+            server->StartDraining();
+          }
+        }
+      }
+      mapper->CommitReleases();
+      auto now = std::chrono::steady_clock::now();
+      const bool tick = now - last_tick >= std::chrono::seconds(1);
+      // Expiry has a resolution of seconds, and sweeping the whole table
+      // every round would slow down dumps read a few buckets per round.
+      if (tick) {
+        mapper->Idle();
+      }
+      // Not while responses wait, they would wait for the chain too.
+      if (server->drained()) {
+        mapper->Reclaim();
+      }
+      if (options.reorder_interval != std::chrono::seconds::zero()
+          && now - last_reorder >= options.reorder_interval
+          && server->drained()) {
+        auto result = mapper->ReorderRules();
+        if (result.moved > 0) {
+          std::clog << "moved " << result.moved << " of " << result.rules
+                    << " rules, " << result.evaluations_before << " to "
+                    << result.evaluations_after
+                    << " evaluations per packet." << std::endl;
+        }
+        last_reorder = now;
+      }
+      if (tick) {
+        if (primary) {
+          primary->Tick();
+        }
+        if (trace) {
+          trace->Flush();
+        }
+        last_tick = now;
+      }
+
+      if (successor_fd >= 0 && server->drained()) {
+        // Replicas reconnect and resync from a snapshot of the successor,
+        // provided it listens where this daemon did before they give up.
+        primary.reset();
+        if (HandOff(successor_fd, *server, stats.get(), *mapper)) {
+          server->Release();
+          if (stats) {
+            stats->Release();
+          }
+          mapper->Release();
+          handoff->Release();
+          std::clog << "handed over to successor." << std::endl;
+          break;
+        }
+        std::clog << "handoff failed, resuming." << std::endl;
+        successor_fd = -1;
+        server->Resume();
+        if (!options.replication_listen.empty()) {
+          primary.reset(new ReplicationPrimary(mapper,
+                                               options.replication_listen));
+        }
+      }
     }
+    return EXIT_SUCCESS;
+  }
+};
+
+} // namespace ipremapd
+
+int main(int argc, char *argv[]) {
+  using namespace ipremapd;
+
+  try {
+    Options options = ParseOptions(argc, argv);
+    // Fork the helper running iptables while the daemon is still small.
+    auto spawner = std::make_shared<Spawner>();
+
+    signal(SIGINT, HandleSigint);
+    return WithPolicy<Daemon>(options.eviction, options, spawner);
   } catch (const std::exception &e) {
     std::cerr << e.what() << std::endl;
     exit(EXIT_FAILURE);
   }
-
-  return EXIT_SUCCESS;
 }
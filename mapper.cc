@@ -22,14 +22,32 @@
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <stdexcept>
 #include <type_traits>
+#include <unordered_map>
+
+#include <netinet/in.h>
+
+#include "basic_mapper.h"
+#include "clock.h"
+#include "eviction.h"
 
 // XXX struct in_addr.s_addr is arguably unportable.
 
 namespace ipremapd {
 
-static std::size_t GetRangeSize(const in_addr &mask) {
-  std::size_t size = 1;
+static constexpr std::size_t kMaxDefaultSize = 1 << 20;
+
+// Reclaim() makes room for the misses expected within the horizon.
+static constexpr std::chrono::seconds kReclaimHorizon(1);
+static constexpr std::chrono::milliseconds kReclaimInterval(100);
+static constexpr std::chrono::milliseconds kMissRateInterval(100);
+static constexpr double kMissRateWeight = 0.25;
+// Buckets read by one ReadSnapshot() call, a few microseconds of work.
+static constexpr std::size_t kSnapshotBuckets = 256;
+
+static std::uint64_t GetRangeSize(const in_addr &mask) {
+  std::uint64_t size = 1;
   for (std::size_t i = 0; i < 32; ++i) {
     if ((mask.s_addr & (1U << i)) == 0) {
       size *= 2;
@@ -38,147 +56,519 @@ static std::size_t GetRangeSize(const in_addr &mask) {
   return size;
 }
 
-Mapper::Mapper(RemapChain chain, const in_addr &range, const in_addr &mask,
-               std::chrono::system_clock::duration ttl)
-    : Mapper(std::move(chain), range, mask, GetRangeSize(mask) / 2, ttl) {
+static std::size_t DefaultSize(const NatPool &pool) {
+  return static_cast<std::size_t>(
+      std::min<std::uint64_t>(pool.size() / 2, kMaxDefaultSize));
 }
 
-Mapper::Mapper(RemapChain chain, const in_addr &range, const in_addr &mask,
+constexpr Mapper::adopt_chain_t Mapper::adopt_chain;
+
+std::uint64_t NatPool::size() const {
+  std::uint64_t size = GetRangeSize(mask);
+  if (port_mode()) {
+    size *= last_port - first_port + 1U;
+  }
+  return size;
+}
+
+Mapper::Mapper(EvictionPolicy policy, RemapChain chain, const NatPool &pool,
                std::size_t max_size, std::chrono::system_clock::duration ttl)
-    : flush_on_destroy_(true), chain_(std::move(chain)), range_(range),
-      mask_(mask), max_size_(max_size), ttl_(ttl) {
-  if (max_size == 0) {
+    : Mapper(policy, adopt_chain, std::move(chain), pool, max_size, ttl) {
+  try {
+    chain_.Flush();
+  } catch (...) {
+    flush_on_destroy_ = false;
+    throw;
+  }
+}
+
+Mapper::Mapper(EvictionPolicy policy, adopt_chain_t, RemapChain chain,
+               const NatPool &pool, std::size_t max_size,
+               std::chrono::system_clock::duration ttl)
+    : eviction_(policy), flush_on_destroy_(true), chain_(std::move(chain)),
+      batch_depth_(0), pool_(pool),
+      max_size_(max_size != 0 ? max_size : DefaultSize(pool)), ttl_(ttl),
+      max_ttl_(ttl),
+      port_dist_(pool.first_port, pool.last_port), low_watermark_(0),
+      high_watermark_(0), recent_misses_(0), miss_rate_(0),
+      miss_rate_time_(MapperClock::steady_now()), epoch_(0) {
+  if (max_size_ == 0) {
     throw std::invalid_argument("the must be space for at least one mapping.");
   }
-  if (GetRangeSize(mask) < max_size) {
+  if (pool.port_mode() && pool.last_port < pool.first_port) {
+    throw std::invalid_argument("invalid port range.");
+  }
+  if (pool.size() < max_size_) {
     throw std::invalid_argument("cannot fit all mappings into the range.");
   }
-  chain_.Flush();
+  in_use_.reserve(max_size_);
 }
 
-Mapper::Mapper(Mapper &&o)
-    : flush_on_destroy_(std::move(o.flush_on_destroy_)),
-      chain_(std::move(o.chain_)), map_(std::move(o.map_)),
-      in_use_(std::move(o.in_use_)), range_(std::move(o.range_)),
-      mask_(std::move(o.mask_)), max_size_(std::move(o.max_size_)),
-      ttl_(std::move(o.ttl_)), dist_(std::move(o.dist_)) {
-  o.flush_on_destroy_ = false;
+Mapper::~Mapper() {
+  if (flush_on_destroy_) {
+    chain_.Flush();
+  }
 }
 
-Mapper &Mapper::operator=(Mapper &&o) {
-  if (this != &o) {
-    flush_on_destroy_ = std::move(o.flush_on_destroy_);
-    chain_ = std::move(o.chain_);
-    map_ = std::move(o.map_);
-    in_use_ = std::move(o.in_use_);
-    range_ = std::move(o.range_);
-    mask_ = std::move(o.mask_);
-    max_size_ = std::move(o.max_size_);
-    dist_ = std::move(o.dist_);
-    o.flush_on_destroy_ = false;
+void Mapper::CommitReleases() {
+  if (released_.empty()) {
+    return;
+  }
+  RemapChain::Batch releases;
+  std::vector<Endpoint> released;
+  std::swap(releases, releases_);
+  std::swap(released, released_);
+  chain_.Commit(releases);
+  for (const auto &nat : released) {
+    in_use_.erase(nat);
   }
-  return *this;
 }
 
-Mapper::~Mapper() {
-  if (flush_on_destroy_) {
-    chain_.Flush();
+std::chrono::system_clock::duration Mapper::GrantedTtl(
+    std::chrono::system_clock::duration ttl) const {
+  if (ttl == std::chrono::system_clock::duration::zero()) {
+    ttl = ttl_;
+  }
+  if (max_ttl_ != std::chrono::system_clock::duration::zero()
+      && (ttl == std::chrono::system_clock::duration::zero()
+          || ttl > max_ttl_)) {
+    ttl = max_ttl_;
   }
+  return ttl;
 }
 
-in_addr Mapper::Map(const in_addr &orig_addr) {
-  auto it = map_.find(orig_addr);
-  if (it == map_.end()) {
-    return ReallyMap(orig_addr);
+std::size_t Mapper::Reclaim() {
+  if (high_watermark_ == 0) {
+    return 0;
+  }
+  const auto now = MapperClock::steady_now();
+  const std::size_t used = mapped_count() + released_.size();
+  const double rate = MissRate();
+  // Unless past the high watermark, pass early when the table would fill
+  // up before the next pass, but at most once per interval.
+  const double next_misses =
+      rate * std::chrono::duration<double>(kReclaimInterval).count();
+  if (used <= high_watermark_
+      && (used + next_misses < max_size_
+          || now - last_reclaim_ < kReclaimInterval)) {
+    return 0;
+  }
+  // Leave room for the misses expected within the horizon.
+  const double horizon_misses =
+      rate * std::chrono::duration<double>(kReclaimHorizon).count();
+  const std::size_t span = high_watermark_ - low_watermark_;
+  std::size_t target = high_watermark_ - std::max<std::size_t>(span / 4, 1);
+  if (max_size_ - horizon_misses < target) {
+    target = static_cast<std::size_t>(
+        std::max<double>(max_size_ - horizon_misses, 0));
+  }
+  target = std::max(target, low_watermark_);
+  if (used <= target) {
+    return 0;
+  }
+  const std::size_t count = std::min(used - target, mapped_count());
+  BeginBatch();
+  try {
+    EvictColdest(count);
+  } catch (...) {
+    CommitBatch();
+    throw;
+  }
+  CommitBatch();
+  last_reclaim_ = now;
+  stats_.reclaimed += count;
+  ++stats_.reclaim_passes;
+  return count;
+}
+
+RemapChain::ReorderResult Mapper::ReorderRules() {
+  assert(batch_depth_ == 0);
+  // Rules about to be deleted should not be moved.
+  CommitReleases();
+  return chain_.Reorder();
+}
+
+void Mapper::set_watermarks(std::size_t low, std::size_t high) {
+  if (high > max_size_ || low > high) {
+    throw std::invalid_argument("invalid watermarks.");
+  }
+  low_watermark_ = low;
+  high_watermark_ = high;
+}
+
+void Mapper::BeginBatch() {
+  ++batch_depth_;
+}
+
+void Mapper::CommitBatch() {
+  assert(batch_depth_ > 0);
+  if (--batch_depth_ == 0 && !batch_.empty()) {
+    RemapChain::Batch batch;
+    std::swap(batch, batch_);
+    chain_.Commit(batch);
+  }
+}
+
+bool Mapper::Accepts(const Endpoint &orig) const {
+  if (!pool_.port_mode()) {
+    return !orig.has_port() && orig.proto == 0;
+  }
+  return orig.has_port()
+      && (orig.proto == IPPROTO_TCP || orig.proto == IPPROTO_UDP);
+}
+
+Endpoint Mapper::NextEndpoint(const Endpoint &orig) {
+  Endpoint nat;
+  do {
+    nat = RandomEndpoint(orig.proto);
+  } while (in_use_.find(nat) != in_use_.cend());
+  return nat;
+}
+
+bool Mapper::IsInUse(const Endpoint &nat) const {
+  return in_use_.find(nat) != in_use_.cend();
+}
+
+bool Mapper::FindUser(const Endpoint &nat, Endpoint *orig) const {
+  auto it = in_use_.find(nat);
+  if (it == in_use_.cend()) {
+    return false;
+  }
+  *orig = it->second;
+  return true;
+}
+
+void Mapper::MarkInUse(const Endpoint &nat, const Endpoint &orig) {
+  in_use_.emplace(nat, orig);
+}
+
+void Mapper::MarkFree(const Endpoint &nat) {
+  in_use_.erase(nat);
+}
+
+void Mapper::DeferDeleteRule(const Endpoint &orig,
+                             const Endpoint &nat) {
+  releases_.DeleteRule(orig, nat);
+  // The NAT address stays in use until its rule is gone.
+  released_.push_back(nat);
+}
+
+void Mapper::AddRule(const Endpoint &orig, const Endpoint &nat) {
+  if (batch_depth_ > 0) {
+    batch_.AddRule(orig, nat);
   } else {
-    it->second.Touch();
-    return it->second.nat_addr();
+    chain_.AddRule(orig, nat);
   }
 }
 
-void Mapper::Idle() {
-  for (auto it = map_.cbegin(); it != map_.cend(); ) {
-    if (it->second.IsExpired(ttl_)) {
-      it = Unmap(it);
+void Mapper::DeleteRule(const Endpoint &orig, const Endpoint &nat) {
+  if (batch_depth_ > 0) {
+    batch_.DeleteRule(orig, nat);
+  } else {
+    chain_.DeleteRule(orig, nat);
+  }
+}
+
+void Mapper::Notify(MapperEvent event, const Endpoint &orig,
+                    const Endpoint &nat,
+                    std::chrono::system_clock::duration ttl) {
+  if (event_callback_) {
+    event_callback_(event, orig, nat, ttl);
+  }
+}
+
+auto Mapper::TakeSnapshot() -> std::shared_ptr<Snapshot> {
+  auto snapshot = std::make_shared<Snapshot>();
+  snapshot->epoch_ = epoch_++;
+  snapshot->bucket_count_ = bucket_count();
+  snapshot->next_bucket_ = 0;
+  snapshot->done_ = false;
+  snapshots_.erase(std::remove_if(snapshots_.begin(), snapshots_.end(),
+                                  [](const std::weak_ptr<Snapshot> &p) {
+                                    return p.expired();
+                                  }),
+                   snapshots_.end());
+  snapshots_.push_back(snapshot);
+  return snapshot;
+}
+
+void Mapper::ReadSnapshot(Snapshot &snapshot, const MappingVisitor &visitor) {
+  if (snapshot.done_) {
+    return;
+  }
+  if (bucket_count() != snapshot.bucket_count_) {
+    throw std::logic_error("table rehashed during a snapshot.");
+  }
+  if (snapshot.next_bucket_ < snapshot.bucket_count_) {
+    const std::size_t end = std::min(snapshot.next_bucket_ + kSnapshotBuckets,
+                                     snapshot.bucket_count_);
+    for (std::size_t i = snapshot.next_bucket_; i < end; ++i) {
+      VisitBucket(i, snapshot.epoch_, visitor);
+    }
+    snapshot.next_bucket_ = end;
+    return;
+  }
+  const std::size_t count = std::min(snapshot.erased_.size(),
+                                     kSnapshotBuckets);
+  const auto first = snapshot.erased_.end() - count;
+  for (auto it = first; it != snapshot.erased_.end(); ++it) {
+    visitor(it->orig, it->nat, it->last_access, it->ttl);
+  }
+  snapshot.erased_.erase(first, snapshot.erased_.end());
+  snapshot.done_ = snapshot.erased_.empty();
+}
+
+void Mapper::SetAsideForSnapshots(
+    std::size_t bucket, std::uint32_t epoch, const Endpoint &orig,
+    const Endpoint &nat, std::chrono::system_clock::time_point last_access,
+    std::chrono::system_clock::duration ttl) {
+  for (auto it = snapshots_.begin(); it != snapshots_.end(); ) {
+    auto snapshot = it->lock();
+    if (!snapshot) {
+      it = snapshots_.erase(it);
+      continue;
+    }
+    if (epoch <= snapshot->epoch_ && bucket >= snapshot->next_bucket_) {
+      snapshot->erased_.push_back({orig, nat, last_access, ttl});
+    }
+    ++it;
+  }
+}
+
+double Mapper::MissRate() {
+  const auto now = MapperClock::steady_now();
+  const std::chrono::duration<double> elapsed = now - miss_rate_time_;
+  if (elapsed < kMissRateInterval) {
+    // Bursts count before the interval is over.
+    const std::chrono::duration<double> interval = kMissRateInterval;
+    return std::max(miss_rate_, recent_misses_ / interval.count());
+  }
+  const double rate = recent_misses_ / elapsed.count();
+  miss_rate_ = kMissRateWeight * rate + (1 - kMissRateWeight) * miss_rate_;
+  recent_misses_ = 0;
+  miss_rate_time_ = now;
+  return miss_rate_;
+}
+
+Endpoint Mapper::RandomEndpoint(std::uint8_t proto) {
+  Endpoint nat;
+  std::uint32_t r = dist_(rand_);
+  nat.addr.s_addr =
+      (pool_.range.s_addr & pool_.mask.s_addr) | (r & ~pool_.mask.s_addr);
+  if (pool_.port_mode()) {
+    nat.port = static_cast<std::uint16_t>(port_dist_(rand_));
+    nat.proto = proto;
+  }
+  return nat;
+}
+
+template <typename Policy>
+void BasicMapper<Policy>::Idle() {
+  const auto now = MapperClock::now();
+  for (auto it = map_.begin(); it != map_.end(); ) {
+    policy_.Sweep(it->second.entry, it->second.last_access, now);
+    if (it->second.IsExpired(now)) {
+      it = Unmap(it, MapperEvent::kExpire);
     } else {
       ++it;
     }
   }
 }
 
-in_addr Mapper::ReallyMap(const in_addr &orig_addr) {
+template <typename Policy>
+std::size_t BasicMapper<Policy>::Preload(
+    const std::vector<in_addr> &orig_addrs) {
+  if (pool().port_mode()) {
+    throw std::invalid_argument("cannot preload whole addresses in port mode.");
+  }
+  std::size_t count = 0;
+  BeginBatch();
+  try {
+    for (const auto &orig : orig_addrs) {
+      if (is_full()) {
+        break;
+      }
+      if (map_.find(orig) == map_.end()) {
+        ReallyMap(orig, ttl());
+        ++count;
+      }
+    }
+  } catch (...) {
+    CommitBatch();
+    throw;
+  }
+  CommitBatch();
+  return count;
+}
+
+template <typename Policy>
+void BasicMapper<Policy>::Insert(
+    const Endpoint &orig, const Endpoint &nat,
+    std::chrono::system_clock::time_point last_access,
+    std::chrono::system_clock::duration ttl) {
+  if (!Accepts(orig)) {
+    throw std::runtime_error("mapping does not fit the NAT pool.");
+  }
+  auto it = map_.find(orig);
+  if (it != map_.end()) {
+    if (it->second.nat == nat) {
+      it->second.last_access = last_access;
+      it->second.ttl = ttl;
+      return;
+    }
+    Unmap(it);
+  }
+  if (IsInUse(nat)) {
+    throw std::runtime_error("NAT address already in use.");
+  }
   if (is_full()) {
     UnmapOne();
-    assert(!is_full());
   }
-  const in_addr nat_addr = NextAddress();
-  chain_.AddRule(orig_addr, nat_addr);
-  map_.emplace(std::piecewise_construct,
-               std::forward_as_tuple(orig_addr),
-               std::forward_as_tuple(nat_addr));
-  in_use_.emplace(nat_addr);
-  return nat_addr;
+  AddMapping(orig, nat, last_access, ttl)->second.leases =
+      Mapping::kUnknownLeases;
 }
 
-auto Mapper::Unmap(unordered_mapping_map::const_iterator it)
-    -> unordered_mapping_map::iterator {
-  chain_.DeleteRule(it->first, it->second.nat_addr());
-  in_use_.erase(it->second.nat_addr());
-  return map_.erase(it);
+template <typename Policy>
+void BasicMapper<Policy>::Erase(const Endpoint &orig) {
+  auto it = map_.find(orig);
+  if (it != map_.end()) {
+    Unmap(it);
+  }
 }
 
-void Mapper::UnmapOne() {
-  typedef unordered_mapping_map::const_reference cref;
-  auto lru = std::min_element(
-      map_.cbegin(), map_.cend(), [](cref a, cref b) {
-      return a.second.last_access() < b.second.last_access();
-    });
-  Unmap(lru);
+template <typename Policy>
+void BasicMapper<Policy>::Clear() {
+  BeginBatch();
+  for (auto it = map_.begin(); it != map_.end(); ) {
+    it = Unmap(it);
+  }
+  CommitBatch();
 }
 
-in_addr Mapper::NextAddress() {
-  in_addr addr;
-  do {
-    addr = RandomAddress();
-  } while (in_use_.find(addr) != in_use_.cend());
-  return addr;
+template <typename Policy>
+void BasicMapper<Policy>::Adopt(
+    const Endpoint &orig, const Endpoint &nat,
+    std::chrono::system_clock::time_point last_access,
+    std::chrono::system_clock::duration ttl) {
+  if (!Accepts(orig)) {
+    throw std::runtime_error("mapping does not fit the NAT pool.");
+  }
+  if (map_.find(orig) != map_.cend() || IsInUse(nat)) {
+    throw std::runtime_error("adopted mapping conflicts with another one.");
+  }
+  // The table is sized for max_size(), and snapshots rely on it never
+  // rehashing.
+  if (is_full()) {
+    throw std::runtime_error("adopted mappings exceed the maximum size.");
+  }
+  Record(orig, nat, last_access, ttl)->second.leases =
+      Mapping::kUnknownLeases;
 }
 
-in_addr Mapper::RandomAddress() {
-  in_addr addr;
-  std::uint32_t r = dist_(rand_);
-  addr.s_addr = (range_.s_addr & mask_.s_addr) | (r & ~mask_.s_addr);
-  return addr;
+template <typename Policy>
+bool BasicMapper<Policy>::ReverseLookup(
+    const Endpoint &nat, const MappingVisitor &visitor) const {
+  Endpoint orig;
+  if (!FindUser(nat, &orig)) {
+    return false;
+  }
+  // Released mappings keep their NAT endpoints until their rules are gone.
+  auto it = map_.find(orig);
+  if (it == map_.cend() || it->second.nat != nat) {
+    return false;
+  }
+  visitor(orig, nat, it->second.last_access, it->second.ttl);
+  return true;
+}
+
+template <typename Policy>
+void BasicMapper<Policy>::VisitBucket(std::size_t bucket, std::uint32_t epoch,
+                                      const MappingVisitor &visitor) const {
+  for (auto it = map_.cbegin(bucket); it != map_.cend(bucket); ++it) {
+    if (it->second.epoch <= epoch) {
+      visitor(it->first, it->second.nat, it->second.last_access,
+              it->second.ttl);
+    }
+  }
+}
+
+template <typename Policy>
+auto BasicMapper<Policy>::ReallyMap(
+    const Endpoint &orig, std::chrono::system_clock::duration ttl)
+    -> typename unordered_mapping_map::iterator {
+  if (is_full() && has_released()) {
+    CommitReleases();
+  }
+  if (is_full()) {
+    UnmapOne();
+    assert(!is_full());
+  }
+  const Endpoint nat = NextEndpoint(orig);
+  auto it = AddMapping(orig, nat, MapperClock::now(), ttl);
+  CountMiss();
+  return it;
 }
 
-Mapper::Mapping::Mapping(in_addr nat_addr)
-    : nat_addr_(nat_addr), last_access_(std::chrono::system_clock::now()) {
+template <typename Policy>
+auto BasicMapper<Policy>::AddMapping(
+    const Endpoint &orig, const Endpoint &nat,
+    std::chrono::system_clock::time_point last_access,
+    std::chrono::system_clock::duration ttl)
+    -> typename unordered_mapping_map::iterator {
+  AddRule(orig, nat);
+  auto it = Record(orig, nat, last_access, ttl);
+  Notify(MapperEvent::kMap, orig, nat, ttl);
+  return it;
 }
 
-void Mapper::Mapping::Touch() {
-  last_access_ = std::chrono::system_clock::now();
+template <typename Policy>
+auto BasicMapper<Policy>::Record(
+    const Endpoint &orig, const Endpoint &nat,
+    std::chrono::system_clock::time_point last_access,
+    std::chrono::system_clock::duration ttl)
+    -> typename unordered_mapping_map::iterator {
+  auto res = map_.emplace(std::piecewise_construct,
+                          std::forward_as_tuple(orig),
+                          std::forward_as_tuple(nat, last_access, ttl,
+                                                epoch()));
+  policy_.Inserted(orig, res.first->second.entry);
+  MarkInUse(nat, orig);
+  return res.first;
 }
 
-bool Mapper::Mapping::IsExpired(
-    std::chrono::system_clock::duration ttl) const {
-  if (ttl == std::chrono::system_clock::duration::zero()) {
-    // Zero TTL means forever.
-    return false;
-  } else {
-    auto age = std::chrono::system_clock::now() - last_access_;
-    return age > ttl;
-  }
+template <typename Policy>
+auto BasicMapper<Policy>::Unmap(
+    typename unordered_mapping_map::iterator it, MapperEvent event)
+    -> typename unordered_mapping_map::iterator {
+  const Endpoint orig = it->first;
+  const Endpoint nat = it->second.nat;
+  const auto ttl = it->second.ttl;
+  DeleteRule(orig, nat);
+  MarkFree(nat);
+  policy_.Erased(it->second.entry);
+  SetAside(it);
+  auto next = map_.erase(it);
+  Notify(event, orig, nat, ttl);
+  return next;
 }
 
-std::size_t Mapper::in_addr_hash::operator()(const in_addr &a) const {
-  std::hash<decltype(a.s_addr)> addr_hash;
-  return addr_hash(a.s_addr);
+template <typename Policy>
+void BasicMapper<Policy>::UnmapOne() {
+  Unmap(policy_.Victim(map_));
+  CountEviction();
 }
 
-bool Mapper::in_addr_equal_to::operator()(const in_addr &a,
-                                          const in_addr &b) const {
-  std::equal_to<decltype(a.s_addr)> addr_equal_to;
-  return addr_equal_to(a.s_addr, b.s_addr);
+template <typename Policy>
+void BasicMapper<Policy>::EvictColdest(std::size_t count) {
+  policy_.EvictColdest(map_, std::min(count, map_.size()),
+                       [this](typename unordered_mapping_map::iterator it) {
+                         Unmap(it);
+                       });
 }
 
+template class BasicMapper<LruPolicy>;
+template class BasicMapper<ClockPolicy>;
+template class BasicMapper<TtlOnlyPolicy>;
+template class BasicMapper<FrequencyPolicy>;
+
 } // namespace ipremapd
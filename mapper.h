@@ -22,86 +22,269 @@
 
 #include <chrono>
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <random>
-#include <unordered_set>
 #include <unordered_map>
+#include <vector>
 
 #include <arpa/inet.h>
 
+#include "endpoint.h"
+#include "eviction.h"
 #include "remap_chain.h"
 
 namespace ipremapd {
 
+enum class MapperEvent {
+  kMap, kUnmap, kExpire
+};
+
+struct MapperStats {
+  // Mappings created for requests.
+  std::uint64_t misses = 0;
+  // Mappings evicted on the request path because the table was full.
+  std::uint64_t evictions = 0;
+  // Mappings evicted by Reclaim(), and its passes.
+  std::uint64_t reclaimed = 0;
+  std::uint64_t reclaim_passes = 0;
+};
+
+// NAT addresses, and in port mode the ports on each of them.
+struct NatPool {
+  in_addr range;
+  in_addr mask;
+  // Zero first_port maps whole addresses.
+  std::uint16_t first_port;
+  std::uint16_t last_port;
+
+  bool port_mode() const { return first_port != 0; }
+  // The number of NAT endpoints per protocol.
+  std::uint64_t size() const;
+};
+
+// Maps original endpoints to NAT endpoints and keeps the chain in sync.
+// The table itself, and with it the request path, is implemented for each
+// EvictionPolicy by BasicMapper in basic_mapper.h. Mapper only serves the
+// parts that need not know the policy.
 class Mapper {
  public:
-  Mapper(RemapChain chain, const in_addr &range, const in_addr &mask,
-         std::chrono::system_clock::duration ttl =
-         std::chrono::system_clock::duration::zero());
-  Mapper(RemapChain chain, const in_addr &range, const in_addr &mask,
-         std::size_t max_size, std::chrono::system_clock::duration ttl =
-         std::chrono::system_clock::duration::zero());
+  typedef std::function<void(MapperEvent event, const Endpoint &orig,
+                             const Endpoint &nat,
+                             std::chrono::system_clock::duration ttl)>
+  EventCallback;
+  typedef std::function<void(const Endpoint &orig,
+                             const Endpoint &nat,
+                             std::chrono::system_clock::time_point last_access,
+                             std::chrono::system_clock::duration ttl)>
+  MappingVisitor;
+
+  // Takes over a chain whose rules were installed by a previous instance,
+  // see Adopt().
+  struct adopt_chain_t {};
+  static constexpr adopt_chain_t adopt_chain {};
+
   Mapper(const Mapper &) = delete;
-  Mapper(Mapper &&);
   Mapper &operator=(const Mapper &) = delete;
-  Mapper &operator=(Mapper &&);
-  ~Mapper();
+  virtual ~Mapper();
 
-  in_addr Map(const in_addr &orig_addr);
-  void Idle();
+  // Whether orig has a port exactly when the pool is in port mode, which
+  // the other methods expect.
+  bool Accepts(const Endpoint &orig) const;
 
-  std::size_t mapped_count() const { return map_.size(); }
-  bool is_full() const { return mapped_count() == max_size_; }
+  // Deletes the rules of mappings released since the previous call in one
+  // transaction.
+  void CommitReleases();
+  // Caps a requested ttl as BasicMapper::Lease() does.
+  std::chrono::system_clock::duration GrantedTtl(
+      std::chrono::system_clock::duration ttl) const;
 
- private:
-  class Mapping {
-   public:
-    explicit Mapping(in_addr nat_addr);
-    
-    const in_addr &nat_addr() const { return nat_addr_; }
-    const std::chrono::system_clock::time_point last_access() const {
-      return last_access_;
-    }
+  // Maps every address not mapped yet, until the table is full, installing
+  // all rules in one chain transaction. Returns the number of new mappings.
+  // Only whole addresses can be preloaded.
+  virtual std::size_t Preload(const std::vector<in_addr> &orig_addrs) = 0;
+
+  // Installs the given mapping as is, e.g. when replaying a replication log.
+  virtual void Insert(const Endpoint &orig, const Endpoint &nat,
+                      std::chrono::system_clock::time_point last_access,
+                      std::chrono::system_clock::duration ttl) = 0;
+  virtual void Erase(const Endpoint &orig) = 0;
+  virtual void Clear() = 0;
+  // Records a mapping whose rule is already in the chain. Throws if the
+  // table is full.
+  virtual void Adopt(const Endpoint &orig, const Endpoint &nat,
+                     std::chrono::system_clock::time_point last_access,
+                     std::chrono::system_clock::duration ttl) = 0;
+  // Evicts the coldest mappings once the table grows past the high
+  // watermark, or would before the next pass at the current miss rate,
+  // deleting their rules in one transaction. The more misses, the closer
+  // to the low watermark it evicts. Returns the number of evictions.
+  std::size_t Reclaim();
+  // Zero high disables Reclaim().
+  void set_watermarks(std::size_t low, std::size_t high);
+
+  // Moves the busiest rules to the top of the chain, see
+  // RemapChain::Reorder().
+  RemapChain::ReorderResult ReorderRules();
+
+  // Leaves the chain intact on destruction for a successor to adopt.
+  void Release() { flush_on_destroy_ = false; }
 
-    void Touch();
-    bool IsExpired(std::chrono::system_clock::duration ttl) const;
+  // Between BeginBatch() and CommitBatch() rule changes are queued and
+  // installed together in a single chain transaction.
+  void BeginBatch();
+  void CommitBatch();
+
+  // Calls visitor(orig, nat, last_access, ttl) for every mapping, see
+  // basic_mapper.h.
+  template <typename F>
+  void ForEachMapping(F visitor) const;
+  // Visits the mapping to nat, if any. Returns false if there is none.
+  virtual bool ReverseLookup(const Endpoint &nat,
+                             const MappingVisitor &visitor) const = 0;
+
+  // The table as of TakeSnapshot(), read a few buckets at a time by
+  // ReadSnapshot() while the table keeps changing. Mappings erased before
+  // the reader gets to them are set aside, and newer ones are skipped.
+  // Last access times and TTLs are read as the reader gets to them.
+  class Snapshot {
+   public:
+    bool done() const { return done_; }
 
    private:
-    in_addr nat_addr_;
-    std::chrono::system_clock::time_point last_access_;
-  };
+    friend class Mapper;
 
-  struct in_addr_hash {
-    std::size_t operator()(const in_addr &a) const;
-  };
+    struct Erased {
+      Endpoint orig;
+      Endpoint nat;
+      std::chrono::system_clock::time_point last_access;
+      std::chrono::system_clock::duration ttl;
+    };
 
-  struct in_addr_equal_to {
-    bool operator()(const in_addr &a, const in_addr &b) const;
+    std::uint32_t epoch_;
+    std::size_t bucket_count_;
+    std::size_t next_bucket_;
+    std::vector<Erased> erased_;
+    bool done_;
   };
 
-  typedef std::unordered_map<in_addr, Mapping, in_addr_hash, in_addr_equal_to>
-  unordered_mapping_map;
+  // The mapper keeps the snapshot up to date until it is dropped.
+  std::shared_ptr<Snapshot> TakeSnapshot();
+  // Visits the mappings of the next few buckets of snapshot, or those set
+  // aside once all buckets are read, until snapshot is done().
+  void ReadSnapshot(Snapshot &snapshot, const MappingVisitor &visitor);
+
+  void set_event_callback(EventCallback callback) {
+    event_callback_ = std::move(callback);
+  }
+
+  // Zero means leases are not capped.
+  std::chrono::system_clock::duration max_ttl() const { return max_ttl_; }
+  void set_max_ttl(std::chrono::system_clock::duration max_ttl) {
+    max_ttl_ = max_ttl;
+  }
+
+  EvictionPolicy eviction() const { return eviction_; }
+  const NatPool &pool() const { return pool_; }
+  const MapperStats &stats() const { return stats_; }
+  virtual std::size_t mapped_count() const = 0;
+  // Derived from the pool if zero was given.
+  std::size_t max_size() const { return max_size_; }
+  bool is_full() const {
+    return mapped_count() + released_.size() >= max_size_;
+  }
 
-  typedef std::unordered_set<in_addr, in_addr_hash, in_addr_equal_to>
-  unordered_in_addr_set;
+ protected:
+  // Uses half of the pool, up to 2^20 mappings, if max_size is zero.
+  Mapper(EvictionPolicy policy, RemapChain chain, const NatPool &pool,
+         std::size_t max_size, std::chrono::system_clock::duration ttl);
+  Mapper(EvictionPolicy policy, adopt_chain_t, RemapChain chain,
+         const NatPool &pool, std::size_t max_size,
+         std::chrono::system_clock::duration ttl);
 
-  in_addr ReallyMap(const in_addr &orig_addr);
-  unordered_mapping_map::iterator Unmap(
-      unordered_mapping_map::const_iterator it);
-  void UnmapOne();
+  std::chrono::system_clock::duration ttl() const { return ttl_; }
+  bool has_released() const { return !released_.empty(); }
+  std::size_t released_count() const { return released_.size(); }
+
+  void CountMiss() {
+    ++stats_.misses;
+    ++recent_misses_;
+  }
+  void CountEviction() { ++stats_.evictions; }
+  // Unmaps count of the coldest mappings.
+  virtual void EvictColdest(std::size_t count) = 0;
+
+  // Bucket interface of the table for snapshots. The table must not be
+  // rehashed while there are any.
+  virtual std::size_t bucket_count() const = 0;
+  virtual void VisitBucket(std::size_t bucket, std::uint32_t epoch,
+                           const MappingVisitor &visitor) const = 0;
+  // Mappings created now are left out of earlier snapshots.
+  std::uint32_t epoch() const { return epoch_; }
+  // Must be called before a mapping is erased from the table.
+  void SetAside(std::size_t bucket, std::uint32_t epoch,
+                const Endpoint &orig, const Endpoint &nat,
+                std::chrono::system_clock::time_point last_access,
+                std::chrono::system_clock::duration ttl) {
+    if (!snapshots_.empty()) {
+      SetAsideForSnapshots(bucket, epoch, orig, nat, last_access, ttl);
+    }
+  }
+
+  // Picks a free NAT endpoint for orig.
+  Endpoint NextEndpoint(const Endpoint &orig);
+  bool IsInUse(const Endpoint &nat) const;
+  // Returns false if nat is free.
+  bool FindUser(const Endpoint &nat, Endpoint *orig) const;
+  void MarkInUse(const Endpoint &nat, const Endpoint &orig);
+  void MarkFree(const Endpoint &nat);
+  // Frees nat once the rule is deleted by CommitReleases().
+  void DeferDeleteRule(const Endpoint &orig, const Endpoint &nat);
+
+  void AddRule(const Endpoint &orig, const Endpoint &nat);
+  void DeleteRule(const Endpoint &orig, const Endpoint &nat);
+  void Notify(MapperEvent event, const Endpoint &orig, const Endpoint &nat,
+              std::chrono::system_clock::duration ttl);
+
+ private:
+  typedef std::unordered_map<Endpoint, Endpoint, EndpointHash>
+  unordered_endpoint_map;
 
-  in_addr NextAddress();
-  in_addr RandomAddress();
+  Endpoint RandomEndpoint(std::uint8_t proto);
+  // Updates and returns the smoothed miss rate.
+  double MissRate();
+  void SetAsideForSnapshots(std::size_t bucket, std::uint32_t epoch,
+                            const Endpoint &orig, const Endpoint &nat,
+                            std::chrono::system_clock::time_point last_access,
+                            std::chrono::system_clock::duration ttl);
 
+  EvictionPolicy eviction_;
   bool flush_on_destroy_;
   RemapChain chain_;
-  unordered_mapping_map map_;
-  unordered_in_addr_set in_use_;
-  in_addr range_;
-  in_addr mask_;
+  RemapChain::Batch batch_;
+  std::size_t batch_depth_;
+  // From NAT endpoints to the original ones using them.
+  unordered_endpoint_map in_use_;
+  NatPool pool_;
   std::size_t max_size_;
   std::chrono::system_clock::duration ttl_;
+  std::chrono::system_clock::duration max_ttl_;
+  RemapChain::Batch releases_;
+  std::vector<Endpoint> released_;
   std::random_device rand_;
   std::uniform_int_distribution<std::uint32_t> dist_;
+  std::uniform_int_distribution<unsigned int> port_dist_;
+  EventCallback event_callback_;
+  std::size_t low_watermark_;
+  std::size_t high_watermark_;
+  std::uint64_t recent_misses_;
+  // Misses per second, smoothed.
+  double miss_rate_;
+  std::chrono::steady_clock::time_point miss_rate_time_;
+  std::chrono::steady_clock::time_point last_reclaim_;
+  MapperStats stats_;
+  std::uint32_t epoch_;
+  std::vector<std::weak_ptr<Snapshot>> snapshots_;
 };
 
 } // namespace ipremapd
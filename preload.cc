@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "preload.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace ipremapd {
+
+static void ParseText(const char *data, std::size_t size,
+                      std::vector<in_addr> &addrs) {
+  const char *end = data + size;
+  const char *line = data;
+  while (line < end) {
+    const char *eol = static_cast<const char *>(
+        memchr(line, '\n', end - line));
+    if (eol == nullptr) {
+      eol = end;
+    }
+    const char *p = line;
+    while (p < eol && (*p == ' ' || *p == '\t')) {
+      ++p;
+    }
+    const char *q = p;
+    while (q < eol && *q != '#' && *q != ' ' && *q != '\t' && *q != '\r') {
+      ++q;
+    }
+    if (q > p) {
+      char buf[INET_ADDRSTRLEN];
+      std::size_t length = static_cast<std::size_t>(q - p);
+      in_addr addr;
+      if (length >= sizeof(buf)) {
+        throw std::runtime_error("invalid address in preload file.");
+      }
+      memcpy(buf, p, length);
+      buf[length] = '\0';
+      if (inet_pton(AF_INET, buf, &addr) <= 0) {
+        throw std::runtime_error("invalid address in preload file.");
+      }
+      addrs.push_back(addr);
+    }
+    line = eol + 1;
+  }
+}
+
+static void ParseBinary(const char *data, std::size_t size,
+                        std::vector<in_addr> &addrs) {
+  if (size % sizeof(in_addr) != 0) {
+    throw std::runtime_error("truncated binary preload file.");
+  }
+  addrs.resize(size / sizeof(in_addr));
+  memcpy(addrs.data(), data, size);
+}
+
+std::vector<in_addr> ReadAddressFile(const std::string &path,
+                                     AddressFileFormat format) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("cannot open preload file.");
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    throw std::runtime_error("fstat failed.");
+  }
+  std::vector<in_addr> addrs;
+  const std::size_t size = static_cast<std::size_t>(st.st_size);
+  if (size == 0) {
+    close(fd);
+    return addrs;
+  }
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("mmap failed.");
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+  try {
+    switch (format) {
+      case AddressFileFormat::kText:
+        ParseText(static_cast<const char *>(data), size, addrs);
+        break;
+      case AddressFileFormat::kBinary:
+        ParseBinary(static_cast<const char *>(data), size, addrs);
+        break;
+    }
+  } catch (...) {
+    munmap(data, size);
+    throw;
+  }
+  munmap(data, size);
+  return addrs;
+}
+
+} // namespace ipremapd
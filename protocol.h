@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IPREMAP_PROTOCOL_H_
+#define IPREMAP_PROTOCOL_H_
+
+/*
+ * Messages exchanged over the SOCK_SEQPACKET client socket.
+ *
+ * A request of exactly sizeof(struct in_addr) bytes maps the address with
+ * the default time-to-live and is answered with the NAT address alone, or
+ * with an all-zero address on error. Requests of
+ * sizeof(struct ipremap_request) bytes are answered with an
+ * struct ipremap_response, and those of sizeof(struct ipremap_port_request)
+ * bytes with a struct ipremap_port_response.
+ *
+ * A daemon started with a NAT port range maps ports and only accepts
+ * struct ipremap_port_request; otherwise it maps whole addresses and
+ * rejects it.
+ *
+ * The stats socket takes struct ipremap_stats_request messages and
+ * answers each with one or more messages of a struct ipremap_stats_header
+ * followed by its count of struct ipremap_mapping. All but the last have
+ * the more flag set.
+ */
+
+#include <stdint.h>
+
+#include <arpa/inet.h>
+
+/*
+ * Clients asking for the same original address share its mapping. Every
+ * IPREMAP_MAP takes a lease on it, and the mapping keeps the longest TTL
+ * any of them asked for. IPREMAP_RELEASE gives one lease back; the mapping
+ * is only deleted once the last lease is released, and otherwise lives
+ * until it expires. So does a mapping taken over from a previous daemon or
+ * a replication primary, whose leases are not known.
+ */
+enum ipremap_op {
+  IPREMAP_MAP = 1,
+  IPREMAP_RENEW = 2,
+  IPREMAP_RELEASE = 3
+};
+
+enum ipremap_status {
+  IPREMAP_OK = 0,
+  IPREMAP_INVALID = 1,
+  IPREMAP_NOT_MAPPED = 2
+};
+
+struct ipremap_request {
+  uint8_t op;
+  uint8_t reserved[3];
+  /* Seconds in network byte order, 0 for the default. Ignored by
+   * IPREMAP_RELEASE. */
+  uint32_t ttl;
+  /* Original address. */
+  struct in_addr addr;
+};
+
+struct ipremap_response {
+  uint8_t status;
+  uint8_t reserved[3];
+  /* Granted seconds in network byte order, 0 for forever. */
+  uint32_t ttl;
+  /* NAT address. */
+  struct in_addr addr;
+};
+
+/* Like struct ipremap_request, but for a port of addr. */
+struct ipremap_port_request {
+  uint8_t op;
+  /* IPPROTO_TCP or IPPROTO_UDP. */
+  uint8_t proto;
+  uint8_t reserved[2];
+  uint32_t ttl;
+  struct in_addr addr;
+  /* Original port in network byte order. */
+  uint16_t port;
+  uint8_t reserved2[2];
+};
+
+struct ipremap_port_response {
+  uint8_t status;
+  uint8_t reserved[3];
+  uint32_t ttl;
+  struct in_addr addr;
+  /* NAT port in network byte order, of the requested protocol. */
+  uint16_t port;
+  uint8_t reserved2[2];
+};
+
+enum ipremap_stats_op {
+  /* Lists the mappings, optionally those of a prefix only. */
+  IPREMAP_DUMP = 1,
+  /* Finds the mapping to a NAT address or, in port mode, NAT port. */
+  IPREMAP_LOOKUP = 2
+};
+
+enum ipremap_filter {
+  IPREMAP_FILTER_NONE = 0,
+  IPREMAP_FILTER_ORIG = 1,
+  IPREMAP_FILTER_NAT = 2
+};
+
+struct ipremap_stats_request {
+  uint8_t op;
+  /* For IPREMAP_DUMP, which address prefix_len and addr filter. */
+  uint8_t filter;
+  uint8_t prefix_len;
+  /* For IPREMAP_LOOKUP in port mode, the protocol and NAT port. */
+  uint8_t proto;
+  struct in_addr addr;
+  uint16_t port;
+  uint8_t reserved[2];
+};
+
+struct ipremap_stats_header {
+  uint8_t status;
+  uint8_t more;
+  /* Mappings following in network byte order. */
+  uint16_t count;
+};
+
+struct ipremap_mapping {
+  struct in_addr orig_addr;
+  struct in_addr nat_addr;
+  /* Ports in network byte order, zero for whole addresses. */
+  uint16_t orig_port;
+  uint16_t nat_port;
+  uint8_t proto;
+  uint8_t reserved[3];
+  /* Seconds since the last use and time-to-live, 0 for forever, in
+   * network byte order. */
+  uint32_t age;
+  uint32_t ttl;
+};
+
+#endif /* IPREMAP_PROTOCOL_H_ */
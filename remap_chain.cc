@@ -19,21 +19,32 @@
 
 #include "remap_chain.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <map>
 #include <stdexcept>
-#include <initializer_list>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "rule_order.h"
+
 namespace ipremapd {
 
 static const char *kIptablesPath = "/sbin/iptables";
+static const char *kIptablesRestorePath = "/sbin/iptables-restore";
+static const char *kIptablesSavePath = "/sbin/iptables-save";
+// Not counting the terminating null.
+static const std::size_t kMaxChainName = 28;
 
 static void SetDevNullOrDie() {
   int devnull;
@@ -61,35 +72,200 @@ static void SetDevNullOrDie() {
 }
 
 static std::vector<char *> BuildArgc(
-    const char *path, std::initializer_list<const char *> args) {
+    const char *path, const std::vector<std::string> &args) {
   std::vector<char *> argc;
   argc.reserve(args.size() + 2);
   argc.push_back(strdup(path));
-  for (const char *item : args) {
-    argc.push_back(strdup(item));
+  for (const auto &item : args) {
+    argc.push_back(strdup(item.c_str()));
   }
   argc.push_back(nullptr);
   return argc;
 }
 
-static void Iptables(std::initializer_list<const char *> args) {
+static void CheckStatus(int status) {
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+    throw std::runtime_error("iptables command failed.");
+  }
+}
+
+static void Run(Spawner *spawner, const char *path,
+                const std::vector<std::string> &args, int input_fd = -1,
+                int output_fd = -1) {
+  if (spawner != nullptr) {
+    CheckStatus(spawner->Run(path, args, input_fd, output_fd));
+    return;
+  }
   pid_t pid = fork();
   if (pid > 0) {
     int status;
     waitpid(pid, &status, 0);
-    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
-      throw std::runtime_error("iptables command failed.");
-    }
+    CheckStatus(status);
   } else if (pid == 0) {
     SetDevNullOrDie();
-    std::vector<char *> argc = BuildArgc(kIptablesPath, args);
-    execv(kIptablesPath, argc.data());
+    if ((input_fd >= 0 && dup2(input_fd, STDIN_FILENO) < 0)
+        || (output_fd >= 0 && dup2(output_fd, STDOUT_FILENO) < 0)) {
+      _Exit(EXIT_FAILURE);
+    }
+    std::vector<char *> argc = BuildArgc(path, args);
+    execv(path, argc.data());
     _Exit(EXIT_FAILURE);
   } else {
     throw std::runtime_error("fork failed.");
   }
 }
 
+// Returns an unlinked temporary file holding script, rewound to its start.
+static int ScriptFile(const std::string &script) {
+  char path[] = "/tmp/ipremapd.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    throw std::runtime_error("mkstemp failed.");
+  }
+  unlink(path);
+  const char *data = script.data();
+  std::size_t left = script.size();
+  while (left > 0) {
+    errno = 0;
+    ssize_t res = write(fd, data, left);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    } else if (res <= 0) {
+      close(fd);
+      throw std::runtime_error("writing rule script failed.");
+    }
+    data += res;
+    left -= static_cast<std::size_t>(res);
+  }
+  if (lseek(fd, 0, SEEK_SET) < 0) {
+    close(fd);
+    throw std::runtime_error("lseek failed.");
+  }
+  return fd;
+}
+
+static std::string ReadFile(int fd) {
+  if (lseek(fd, 0, SEEK_SET) < 0) {
+    throw std::runtime_error("lseek failed.");
+  }
+  std::string data;
+  char buf[64 * 1024];
+  for (;;) {
+    errno = 0;
+    ssize_t res = read(fd, buf, sizeof(buf));
+    if (res < 0 && errno == EINTR) {
+      continue;
+    } else if (res < 0) {
+      throw std::runtime_error("reading command output failed.");
+    } else if (res == 0) {
+      return data;
+    }
+    data.append(buf, static_cast<std::size_t>(res));
+  }
+}
+
+struct SavedRule {
+  std::uint64_t packets;
+  // Byte counter and rule specification as saved.
+  std::string bytes;
+  std::string spec;
+};
+
+// Parses the "[packets:bytes] -A chain spec" lines of chain and its
+// sub-chains from the output of iptables-save -c, by chain in chain order.
+// Chains of other daemons may share the prefix, SubChains() tells which
+// chain jumps to.
+static std::map<std::string, std::vector<SavedRule>> ParseSavedRules(
+    const std::string &saved, const std::string &chain) {
+  const std::string append = "] -A ";
+  std::map<std::string, std::vector<SavedRule>> rules;
+  std::size_t line = 0;
+  while (line < saved.size()) {
+    std::size_t eol = saved.find('\n', line);
+    if (eol == std::string::npos) {
+      eol = saved.size();
+    }
+    const std::size_t close = saved.find(append, line);
+    const std::size_t colon = saved.find(':', line);
+    const std::size_t name = close + append.size();
+    const std::size_t space = saved.find(' ', name);
+    const std::size_t end = name + chain.size();
+    // Sub-chain names continue chain with a dash.
+    if (saved[line] == '[' && close < eol && colon < close && space < eol
+        && saved.compare(name, chain.size(), chain) == 0
+        && (space == end || saved[end] == '-')) {
+      SavedRule rule;
+      rule.packets = std::strtoull(saved.c_str() + line + 1, nullptr, 10);
+      rule.bytes = saved.substr(colon + 1, close - colon - 1);
+      rule.spec = saved.substr(space + 1, eol - space - 1);
+      rules[saved.substr(name, space - name)].push_back(std::move(rule));
+    }
+    line = eol + 1;
+  }
+  return rules;
+}
+
+// Returns the sub-chains the rules of chain jump to.
+static std::unordered_set<std::string> SubChains(
+    const std::map<std::string, std::vector<SavedRule>> &rules,
+    const std::string &chain) {
+  std::unordered_set<std::string> sub_chains;
+  auto it = rules.find(chain);
+  if (it == rules.end()) {
+    return sub_chains;
+  }
+  const std::string jump = "-j " + chain + "-";
+  for (const auto &rule : it->second) {
+    const std::size_t pos = rule.spec.rfind(jump);
+    if (pos != std::string::npos) {
+      sub_chains.insert(rule.spec.substr(pos + 3));
+    }
+  }
+  return sub_chains;
+}
+
+static void AppendArgs(std::string *line,
+                       const std::vector<std::string> &args) {
+  for (const auto &arg : args) {
+    *line += ' ';
+    *line += arg;
+  }
+}
+
+// Leaves room for the longest sub-chain suffix, "-255.255.255".
+static const std::string &CheckChainName(const std::string &name) {
+  if (name.empty() || name.size() + 12 > kMaxChainName) {
+    throw std::invalid_argument("chain name too long.");
+  }
+  return name;
+}
+
+// Appends to script the commands that bring the rules of chain into
+// order, and returns how many rules move.
+static std::size_t MoveRules(const std::string &chain,
+                             const std::vector<SavedRule> &rules,
+                             const std::vector<std::size_t> &order,
+                             std::string *script) {
+  const std::vector<bool> move = RulesToMove(order);
+  std::size_t moved = 0;
+  // Deleting from the bottom up keeps the positions of the others.
+  for (std::size_t i = rules.size(); i-- > 0; ) {
+    if (move[i]) {
+      *script += "-D " + chain + " " + std::to_string(i + 1) + "\n";
+      ++moved;
+    }
+  }
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    const SavedRule &rule = rules[order[i]];
+    if (move[order[i]]) {
+      *script += "[" + std::to_string(rule.packets) + ":" + rule.bytes
+          + "] -I " + chain + " " + std::to_string(i + 1) + " " + rule.spec
+          + "\n";
+    }
+  }
+  return moved;
+}
+
 static std::string AddressToString(in_addr addr) {
   char buf[INET_ADDRSTRLEN];
   const char *res = inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
@@ -99,35 +275,282 @@ static std::string AddressToString(in_addr addr) {
   return std::string(res);
 }
 
-RemapChain::RemapChain(const std::string &name) : name_(name) {
+static std::string EndpointToString(const Endpoint &endpoint) {
+  std::string str = AddressToString(endpoint.addr);
+  if (endpoint.has_port()) {
+    str += ':';
+    str += std::to_string(endpoint.port);
+  }
+  return str;
+}
+
+static const char *ProtocolName(std::uint8_t proto) {
+  switch (proto) {
+    case IPPROTO_TCP:
+      return "tcp";
+    case IPPROTO_UDP:
+      return "udp";
+  }
+  throw std::invalid_argument("unsupported protocol.");
+}
+
+RuleSink::~RuleSink() {
+}
+
+RemapChain::RemapChain(const std::string &name)
+    : name_(CheckChainName(name)), buckets_loaded_(false) {
+}
+
+RemapChain::RemapChain(const std::string &name,
+                       const std::shared_ptr<Spawner> &spawner)
+    : name_(CheckChainName(name)), spawner_(spawner),
+      buckets_loaded_(false) {
+}
+
+RemapChain::RemapChain(const std::string &name,
+                       const std::shared_ptr<RuleSink> &sink)
+    : name_(name), sink_(sink), buckets_loaded_(false) {
 }
 
 void RemapChain::Flush() {
-  Iptables({"-t", "nat", "-F", name_.c_str()});
+  if (sink_) {
+    sink_->Flush();
+    return;
+  }
+  const auto sub_chains = SubChains(ParseSavedRules(IptablesSave(), name_),
+                                    name_);
+  // Declaring a chain empties it, and sub-chains must be empty and
+  // unreferenced to be deleted.
+  std::string script("*nat\n:" + name_ + " - [0:0]\n");
+  for (const auto &chain : sub_chains) {
+    script += ":" + chain + " - [0:0]\n-X " + chain + "\n";
+  }
+  script += "COMMIT\n";
+  IptablesRestore(script);
+  buckets_.clear();
+  buckets_loaded_ = true;
 }
 
-void RemapChain::AddRule(in_addr orig, in_addr nat) {
+void RemapChain::AddRule(const Endpoint &orig, const Endpoint &nat) {
   RuleAction(Action::kAdd, orig, nat);
 }
 
-void RemapChain::DeleteRule(in_addr orig, in_addr nat) {
+void RemapChain::DeleteRule(const Endpoint &orig, const Endpoint &nat) {
   RuleAction(Action::kDelete, orig, nat);
 }
 
-void RemapChain::RuleAction(Action action, in_addr orig, in_addr nat) {
-  const char *action_arg;
+void RemapChain::Commit(const Batch &batch) {
+  if (batch.empty()) {
+    return;
+  }
+  if (sink_) {
+    std::size_t added = 0;
+    for (const auto &rule : batch.rules_) {
+      if (std::get<0>(rule) == Action::kAdd) {
+        ++added;
+      }
+    }
+    sink_->Apply(added, batch.size() - added);
+    return;
+  }
+  LoadBuckets();
+  // New sub-chains and their jumps come first.
+  std::string script("*nat\n");
+  std::string rules;
+  std::vector<std::string> created;
+  for (const auto &rule : batch.rules_) {
+    const Bucket bucket = BucketOf(std::get<2>(rule));
+    if (std::get<0>(rule) == Action::kAdd
+        && buckets_.count(bucket.chain) == 0
+        && std::find(created.begin(), created.end(), bucket.chain)
+            == created.end()) {
+      script += ":" + bucket.chain + " - [0:0]\n-A " + name_;
+      AppendArgs(&script, bucket.match);
+      script += " -j " + bucket.chain + "\n";
+      created.push_back(bucket.chain);
+    }
+    rules += ActionArg(std::get<0>(rule));
+    rules += ' ';
+    rules += bucket.chain;
+    AppendArgs(&rules, RuleArgs(std::get<1>(rule), std::get<2>(rule)));
+    rules += '\n';
+  }
+  script += rules;
+  script += "COMMIT\n";
+  IptablesRestore(script);
+  buckets_.insert(created.begin(), created.end());
+}
+
+auto RemapChain::Reorder() -> ReorderResult {
+  ReorderResult result;
+  if (sink_) {
+    return result;
+  }
+  const auto chains = ParseSavedRules(IptablesSave(), name_);
+  buckets_ = SubChains(chains, name_);
+  buckets_loaded_ = true;
+  std::unordered_map<std::string, std::uint64_t> last_packets;
+  std::string script("*nat\n");
+  // Sub-chain averages are weighted by the packets of each.
+  double sub_packets = 0;
+  double sub_before = 0;
+  double sub_after = 0;
+  for (const auto &chain : chains) {
+    if (chain.first != name_ && buckets_.count(chain.first) == 0) {
+      continue;
+    }
+    const std::vector<SavedRule> &rules = chain.second;
+    std::vector<std::uint64_t> packets;
+    packets.reserve(rules.size());
+    double total = 0;
+    for (const auto &rule : rules) {
+      std::string key = chain.first + " " + rule.spec;
+      auto it = last_packets_.find(key);
+      // Rules deleted and added again start counting afresh.
+      packets.push_back(it != last_packets_.end() && it->second <= rule.packets
+                        ? rule.packets - it->second : rule.packets);
+      total += static_cast<double>(packets.back());
+      last_packets.emplace(std::move(key), rule.packets);
+    }
+
+    std::vector<std::size_t> current(rules.size());
+    for (std::size_t i = 0; i < current.size(); ++i) {
+      current[i] = i;
+    }
+    const std::vector<std::size_t> order = HotFirstOrder(packets);
+    const double before = AverageEvaluations(packets, current);
+    const double after = AverageEvaluations(packets, order);
+    if (chain.first == name_) {
+      result.evaluations_before += before;
+      result.evaluations_after += after;
+    } else {
+      sub_packets += total;
+      sub_before += before * total;
+      sub_after += after * total;
+    }
+    result.rules += rules.size();
+    result.moved += MoveRules(chain.first, rules, order, &script);
+  }
+  last_packets_ = std::move(last_packets);
+  if (sub_packets > 0) {
+    result.evaluations_before += sub_before / sub_packets;
+    result.evaluations_after += sub_after / sub_packets;
+  }
+  if (result.moved == 0) {
+    return result;
+  }
+  script += "COMMIT\n";
+  IptablesRestore(script, {"--noflush", "--counters"});
+  return result;
+}
+
+auto RemapChain::BucketOf(const Endpoint &nat) const -> Bucket {
+  Bucket bucket;
+  if (nat.has_port()) {
+    const unsigned first = nat.port & ~0xffu;
+    const char *proto = ProtocolName(nat.proto);
+    bucket.chain = name_ + "-" + proto + "-" + std::to_string(first >> 8);
+    bucket.match = {"-p", proto, "--dport", std::to_string(first) + ":"
+                    + std::to_string(first + 0xff)};
+    return bucket;
+  }
+  in_addr net;
+  net.s_addr = htonl(ntohl(nat.addr.s_addr) & 0xffffff00u);
+  const std::string prefix = AddressToString(net);
+  bucket.chain = name_ + "-" + prefix.substr(0, prefix.rfind('.'));
+  bucket.match = {"--dst", prefix + "/24"};
+  return bucket;
+}
+
+void RemapChain::LoadBuckets() {
+  if (buckets_loaded_) {
+    return;
+  }
+  buckets_ = SubChains(ParseSavedRules(IptablesSave(), name_), name_);
+  buckets_loaded_ = true;
+}
+
+const char *RemapChain::ActionArg(Action action) {
   switch (action) {
     case Action::kAdd:
-      action_arg = "-A";
-      break;
+      return "-A";
     case Action::kDelete:
-      action_arg = "-D";
-      break;
+      return "-D";
+  }
+  throw std::logic_error("unknown rule action.");
+}
+
+std::vector<std::string> RemapChain::RuleArgs(const Endpoint &orig,
+                                              const Endpoint &nat) {
+  if (nat.has_port()) {
+    return {"-p", ProtocolName(nat.proto), "--dst", AddressToString(nat.addr),
+            "--dport", std::to_string(nat.port), "-j", "DNAT", "--to",
+            EndpointToString(orig)};
+  }
+  return {"--dst", AddressToString(nat.addr), "-j", "DNAT", "--to",
+          EndpointToString(orig)};
+}
+
+void RemapChain::RuleAction(Action action, const Endpoint &orig,
+                            const Endpoint &nat) {
+  if (sink_) {
+    sink_->Apply(action == Action::kAdd, action == Action::kDelete);
+    return;
+  }
+  LoadBuckets();
+  const Bucket bucket = BucketOf(nat);
+  if (action == Action::kAdd && buckets_.count(bucket.chain) == 0) {
+    // Creates the sub-chain and its jump in the same transaction.
+    Batch batch;
+    batch.AddRule(orig, nat);
+    Commit(batch);
+    return;
+  }
+  std::vector<std::string> args = {"-t", "nat", ActionArg(action),
+                                   bucket.chain};
+  for (auto &arg : RuleArgs(orig, nat)) {
+    args.push_back(std::move(arg));
+  }
+  Iptables(args);
+}
+
+void RemapChain::Batch::AddRule(const Endpoint &orig, const Endpoint &nat) {
+  rules_.emplace_back(Action::kAdd, orig, nat);
+}
+
+void RemapChain::Batch::DeleteRule(const Endpoint &orig,
+                                   const Endpoint &nat) {
+  rules_.emplace_back(Action::kDelete, orig, nat);
+}
+
+void RemapChain::Iptables(const std::vector<std::string> &args) {
+  Run(spawner_.get(), kIptablesPath, args);
+}
+
+void RemapChain::IptablesRestore(const std::string &script,
+                                 const std::vector<std::string> &args) {
+  int fd = ScriptFile(script);
+  try {
+    Run(spawner_.get(), kIptablesRestorePath, args, fd);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+}
+
+std::string RemapChain::IptablesSave() {
+  // An empty script file takes the output.
+  int fd = ScriptFile(std::string());
+  try {
+    Run(spawner_.get(), kIptablesSavePath, {"-t", "nat", "-c"}, -1, fd);
+    std::string saved = ReadFile(fd);
+    close(fd);
+    return saved;
+  } catch (...) {
+    close(fd);
+    throw;
   }
-  const std::string orig_str = AddressToString(orig);
-  const std::string nat_str = AddressToString(nat);
-  Iptables({"-t", "nat", action_arg, name_.c_str(), "--dst", nat_str.c_str(),
-          "-j", "DNAT", "--to", orig_str.c_str()});
 }
 
 } // namespace ipremapd
@@ -20,28 +20,112 @@
 #ifndef IPREMAPD_REMAP_CHAIN_H_
 #define IPREMAPD_REMAP_CHAIN_H_
 
+#include <memory>
 #include <string>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <arpa/inet.h>
 
+#include "endpoint.h"
+#include "spawner.h"
+
 namespace ipremapd {
 
+// Receives rule changes in place of iptables, e.g. to simulate the chain.
+class RuleSink {
+ public:
+  virtual ~RuleSink();
+
+  // Called once for every iptables command or transaction.
+  virtual void Apply(std::size_t added, std::size_t deleted) = 0;
+  virtual void Flush() = 0;
+};
+
+// The chain of DNAT rules, spread over sub-chains of the NAT addresses
+// of a /24 each, or of 256 NAT ports of a protocol, which the top chain
+// jumps to so that packets only meet the rules of their own sub-chain.
 class RemapChain {
+ private:
+  enum class Action {
+    kAdd, kDelete
+  };
+
  public:
+  // Rule changes collected for a single iptables-restore transaction.
+  class Batch {
+   public:
+    void AddRule(const Endpoint &orig, const Endpoint &nat);
+    void DeleteRule(const Endpoint &orig, const Endpoint &nat);
+    void Clear() { rules_.clear(); }
+
+    bool empty() const { return rules_.empty(); }
+    std::size_t size() const { return rules_.size(); }
+
+   private:
+    friend class RemapChain;
+
+    std::vector<std::tuple<Action, Endpoint, Endpoint>> rules_;
+  };
+
   explicit RemapChain(const std::string &name);
-  
+  // Runs iptables through spawner instead of forking the caller.
+  RemapChain(const std::string &name,
+             const std::shared_ptr<Spawner> &spawner);
+  // Passes rule changes to sink without running iptables.
+  RemapChain(const std::string &name, const std::shared_ptr<RuleSink> &sink);
+
+  // Empties the top chain and deletes its sub-chains.
   void Flush();
-  void AddRule(in_addr orig, in_addr nat);
-  void DeleteRule(in_addr orig, in_addr nat);
+  // Endpoints with ports get a rule matching the NAT port only.
+  void AddRule(const Endpoint &orig, const Endpoint &nat);
+  void DeleteRule(const Endpoint &orig, const Endpoint &nat);
+  void Commit(const Batch &batch);
+
+  struct ReorderResult {
+    std::size_t rules = 0;
+    std::size_t moved = 0;
+    // Average rules evaluated per matched packet since the previous call
+    // in the top chain and a sub-chain, and what it would have been in the
+    // new order.
+    double evaluations_before = 0;
+    double evaluations_after = 0;
+  };
+  // Moves the rules that matched the most packets since the previous call
+  // to the top of their chains, keeping their counters, in one
+  // transaction. Rules that are in order already are left alone.
+  ReorderResult Reorder();
 
  private:
-  enum class Action {
-    kAdd, kDelete
+  struct Bucket {
+    std::string chain;
+    // Matches the packets the top chain sends to chain.
+    std::vector<std::string> match;
   };
 
-  void RuleAction(Action action, in_addr orig, in_addr nat);
+  static const char *ActionArg(Action action);
+  static std::vector<std::string> RuleArgs(const Endpoint &orig,
+                                           const Endpoint &nat);
+
+  Bucket BucketOf(const Endpoint &nat) const;
+  // Learns the existing sub-chains, e.g. of an adopted chain, once.
+  void LoadBuckets();
+  void RuleAction(Action action, const Endpoint &orig, const Endpoint &nat);
+  void Iptables(const std::vector<std::string> &args);
+  void IptablesRestore(const std::string &script,
+                       const std::vector<std::string> &args = {"--noflush"});
+  std::string IptablesSave();
 
   std::string name_;
+  std::shared_ptr<Spawner> spawner_;
+  std::shared_ptr<RuleSink> sink_;
+  // Sub-chains that exist, once buckets_loaded_.
+  std::unordered_set<std::string> buckets_;
+  bool buckets_loaded_;
+  // Packet counters by chain and rule, as of the previous Reorder().
+  std::unordered_map<std::string, std::uint64_t> last_packets_;
 };
 
 } // namespace ipremapd
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Simulates a chain of DNAT rules whose packets follow a Zipf distribution
+// over rules added in random order, with popularity drifting a little
+// every interval. Reports the average rules evaluated per packet when the
+// chain keeps its insertion order and when it is reordered by the packets
+// of the previous interval, either exactly or as the daemon does it, and
+// how many rules each interval moves.
+//
+// usage: reorder_bench [RULES [INTERVALS]]
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "rule_order.h"
+
+namespace {
+
+using namespace ipremapd;
+
+// Ranks of rules swapped each interval, per thousand rules.
+const std::size_t kDriftPerMille = 10;
+const std::uint64_t kPacketsPerRule = 100;
+
+std::vector<std::size_t> ExactOrder(const std::vector<std::uint64_t> &packets) {
+  std::vector<std::size_t> order(packets.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&packets](std::size_t a, std::size_t b) {
+                     return packets[a] > packets[b];
+                   });
+  return order;
+}
+
+class Chain {
+ public:
+  explicit Chain(std::vector<std::size_t> rules)
+      : rules_(std::move(rules)), evaluations_(0), moved_(0) {
+  }
+
+  // Counts the evaluations of packets, indexed by rule, then reorders.
+  template <typename Plan>
+  void Interval(const std::vector<std::uint64_t> &packets, Plan plan) {
+    std::vector<std::uint64_t> in_chain(rules_.size());
+    for (std::size_t i = 0; i < rules_.size(); ++i) {
+      in_chain[i] = packets[rules_[i]];
+    }
+    std::vector<std::size_t> current(rules_.size());
+    std::iota(current.begin(), current.end(), 0);
+    evaluations_ += AverageEvaluations(in_chain, current);
+    const std::vector<std::size_t> order = plan(in_chain);
+    const std::vector<bool> move = RulesToMove(order);
+    moved_ += std::count(move.begin(), move.end(), true);
+    std::vector<std::size_t> rules(rules_.size());
+    for (std::size_t i = 0; i < order.size(); ++i) {
+      rules[i] = rules_[order[i]];
+    }
+    rules_ = std::move(rules);
+  }
+
+  double evaluations() const { return evaluations_; }
+  std::size_t moved() const { return moved_; }
+
+ private:
+  std::vector<std::size_t> rules_;
+  double evaluations_;
+  std::size_t moved_;
+};
+
+void Report(const char *name, const Chain &chain, std::size_t intervals) {
+  std::cout << std::setw(10) << name << std::setw(16) << std::fixed
+            << std::setprecision(1) << chain.evaluations() / intervals
+            << std::setw(14) << static_cast<double>(chain.moved()) / intervals
+            << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const std::size_t rule_count =
+      argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000;
+  const std::size_t intervals =
+      argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 50;
+  if (rule_count == 0 || intervals == 0) {
+    std::cerr << "rules and intervals must be positive." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::mt19937 rand(42);
+  std::vector<double> weights(rule_count);
+  double sum = 0;
+  for (std::size_t i = 0; i < rule_count; ++i) {
+    weights[i] = 1.0 / (i + 1);
+    sum += weights[i];
+  }
+  // rank[rule] is the popularity rank of the rule, added in rule order.
+  std::vector<std::size_t> rank(rule_count);
+  std::iota(rank.begin(), rank.end(), 0);
+  std::shuffle(rank.begin(), rank.end(), rand);
+
+  std::vector<std::size_t> insertion(rule_count);
+  std::iota(insertion.begin(), insertion.end(), 0);
+  Chain appended(insertion);
+  Chain exact(insertion);
+  Chain banded(insertion);
+  const std::uint64_t total = kPacketsPerRule * rule_count;
+  std::uniform_int_distribution<std::size_t> pick(0, rule_count - 1);
+  std::vector<std::uint64_t> packets(rule_count);
+  for (std::size_t interval = 0; interval < intervals; ++interval) {
+    for (std::size_t rule = 0; rule < rule_count; ++rule) {
+      std::poisson_distribution<std::uint64_t> dist(
+          total * weights[rank[rule]] / sum);
+      packets[rule] = dist(rand);
+    }
+    appended.Interval(packets, [](const std::vector<std::uint64_t> &p) {
+      std::vector<std::size_t> order(p.size());
+      std::iota(order.begin(), order.end(), 0);
+      return order;
+    });
+    exact.Interval(packets, ExactOrder);
+    banded.Interval(packets, HotFirstOrder);
+    for (std::size_t i = 0; i < rule_count * kDriftPerMille / 1000; ++i) {
+      std::swap(rank[pick(rand)], rank[pick(rand)]);
+    }
+  }
+
+  std::cout << rule_count << " rules, " << intervals << " intervals of "
+            << total << " packets\n"
+            << std::setw(10) << "order" << std::setw(16)
+            << "evaluations" << std::setw(14) << "moved" << std::endl;
+  Report("appended", appended, intervals);
+  Report("exact", exact, intervals);
+  Report("banded", banded, intervals);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,695 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "replication.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "basic_mapper.h"
+#include "clock.h"
+
+#ifndef UNIX_PATH_MAX
+// man 7 unix says UNIX_PATH_MAX should be defined, but it isn't.
+#define UNIX_PATH_MAX sizeof(std::declval<sockaddr_un>().sun_path)
+#endif
+
+namespace ipremapd {
+
+namespace {
+
+enum RecordType : unsigned char {
+  kSnapshotBegin = 1,
+  kSnapshotEnd,
+  kMap,
+  kUnmap,
+  kExpire,
+  kHeartbeat,
+  // Refreshes the age of a mapping used since the previous tick. Touches
+  // change no mapping, so like heartbeats they carry the current sequence
+  // number rather than a new one.
+  kTouch
+};
+
+// type (1), protocol (1), padding (2), sequence number (8, big endian),
+// original address (4) and NAT address (4), both in network byte order,
+// time-to-live in seconds (4), original port (2), NAT port (2) and seconds
+// since the last use (4), all big endian. Ports are zero for whole-address
+// mappings. Mappings are created and leased on use, so map records in the
+// log have zero age.
+constexpr std::size_t kRecordSize = 32;
+
+constexpr std::chrono::seconds kPrimaryTimeout(5);
+// A reconnected primary starts sending its snapshot right away.
+constexpr std::chrono::seconds kResyncTimeout(2);
+
+void EncodeRecord(char *buf, RecordType type, std::uint64_t seq,
+                  const Endpoint &orig = Endpoint(),
+                  const Endpoint &nat = Endpoint(),
+                  std::chrono::system_clock::duration ttl =
+                  std::chrono::system_clock::duration::zero(),
+                  std::chrono::system_clock::duration age =
+                  std::chrono::system_clock::duration::zero()) {
+  memset(buf, 0, kRecordSize);
+  buf[0] = static_cast<char>(type);
+  buf[1] = static_cast<char>(orig.proto);
+  for (int i = 0; i < 8; ++i) {
+    buf[4 + i] = static_cast<char>((seq >> (56 - 8 * i)) & 0xff);
+  }
+  memcpy(buf + 12, &orig.addr, sizeof(orig.addr));
+  memcpy(buf + 16, &nat.addr, sizeof(nat.addr));
+  std::uint32_t ttl_sec = htonl(static_cast<std::uint32_t>(
+      std::chrono::duration_cast<std::chrono::seconds>(ttl).count()));
+  memcpy(buf + 20, &ttl_sec, sizeof(ttl_sec));
+  std::uint16_t port = htons(orig.port);
+  memcpy(buf + 24, &port, sizeof(port));
+  port = htons(nat.port);
+  memcpy(buf + 26, &port, sizeof(port));
+  std::uint32_t age_sec = htonl(static_cast<std::uint32_t>(
+      std::chrono::duration_cast<std::chrono::seconds>(
+          std::max(age, std::chrono::system_clock::duration::zero()))
+      .count()));
+  memcpy(buf + 28, &age_sec, sizeof(age_sec));
+}
+
+// Returns the original and NAT endpoints of a record.
+std::pair<Endpoint, Endpoint> DecodeEndpoints(const char *buf) {
+  const std::uint8_t proto = static_cast<std::uint8_t>(buf[1]);
+  in_addr orig_addr, nat_addr;
+  memcpy(&orig_addr, buf + 12, sizeof(orig_addr));
+  memcpy(&nat_addr, buf + 16, sizeof(nat_addr));
+  std::uint16_t orig_port, nat_port;
+  memcpy(&orig_port, buf + 24, sizeof(orig_port));
+  memcpy(&nat_port, buf + 26, sizeof(nat_port));
+  return {Endpoint(orig_addr, ntohs(orig_port), proto),
+          Endpoint(nat_addr, ntohs(nat_port), proto)};
+}
+
+std::uint64_t DecodeSeq(const char *buf) {
+  std::uint64_t seq = 0;
+  for (int i = 0; i < 8; ++i) {
+    seq = (seq << 8) | static_cast<unsigned char>(buf[i]);
+  }
+  return seq;
+}
+
+void EncodeSeq(char *buf, std::uint64_t seq) {
+  for (int i = 0; i < 8; ++i) {
+    buf[i] = static_cast<char>((seq >> (56 - 8 * i)) & 0xff);
+  }
+}
+
+bool IsUnixSpec(const std::string &spec) {
+  return spec.find('/') != std::string::npos;
+}
+
+sockaddr_un UnixAddress(const std::string &path) {
+  if (path.length() >= UNIX_PATH_MAX) {
+    throw std::invalid_argument("path too long.");
+  }
+  sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, path.c_str(), UNIX_PATH_MAX);
+  return sa;
+}
+
+addrinfo *ResolveTcp(const std::string &spec, bool passive) {
+  std::size_t colon = spec.rfind(':');
+  if (colon == std::string::npos) {
+    throw std::invalid_argument("expected host:port.");
+  }
+  const std::string host = spec.substr(0, colon);
+  const std::string port = spec.substr(colon + 1);
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  addrinfo *res;
+  if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+                  &hints, &res) != 0) {
+    throw std::runtime_error("getaddrinfo failed.");
+  }
+  return res;
+}
+
+int ListenOn(const std::string &spec, int backlog) {
+  int fd;
+  if (IsUnixSpec(spec)) {
+    sockaddr_un sa = UnixAddress(spec);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+      throw std::runtime_error("socket failed.");
+    }
+    if (bind(fd, reinterpret_cast<const sockaddr *>(&sa), sizeof(sa)) < 0) {
+      close(fd);
+      throw std::runtime_error("bind failed.");
+    }
+  } else {
+    addrinfo *res = ResolveTcp(spec, true);
+    fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK,
+                res->ai_protocol);
+    if (fd < 0) {
+      freeaddrinfo(res);
+      throw std::runtime_error("socket failed.");
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
+      freeaddrinfo(res);
+      close(fd);
+      throw std::runtime_error("bind failed.");
+    }
+    freeaddrinfo(res);
+  }
+  if (listen(fd, backlog) < 0) {
+    close(fd);
+    if (IsUnixSpec(spec)) {
+      unlink(spec.c_str());
+    }
+    throw std::runtime_error("listen failed.");
+  }
+  return fd;
+}
+
+// Returns -1 if the peer cannot be reached.
+int ConnectTo(const std::string &spec) {
+  int fd;
+  if (IsUnixSpec(spec)) {
+    sockaddr_un sa = UnixAddress(spec);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      throw std::runtime_error("socket failed.");
+    }
+    if (connect(fd, reinterpret_cast<const sockaddr *>(&sa),
+                sizeof(sa)) < 0) {
+      close(fd);
+      return -1;
+    }
+  } else {
+    addrinfo *res = ResolveTcp(spec, false);
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) {
+      freeaddrinfo(res);
+      throw std::runtime_error("socket failed.");
+    }
+    if (connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+      freeaddrinfo(res);
+      close(fd);
+      return -1;
+    }
+    freeaddrinfo(res);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+class replica_exception : public std::exception {
+};
+
+} // namespace
+
+constexpr std::uint64_t ReplicationPrimary::kDefaultMaxLag;
+
+ReplicationPrimary::ReplicationPrimary(const std::shared_ptr<Mapper> &mapper,
+                                       const std::string &listen_spec,
+                                       std::uint64_t max_lag)
+    : mapper_(mapper), max_lag_(max_lag), head_seq_(0),
+      touched_since_(MapperClock::now()) {
+  socket_fd_ = ListenOn(listen_spec, kBacklogSize);
+  if (IsUnixSpec(listen_spec)) {
+    unix_path_ = listen_spec;
+  }
+  mapper_->set_event_callback(
+      [this](MapperEvent event, const Endpoint &orig, const Endpoint &nat,
+             std::chrono::system_clock::duration ttl) {
+        Append(event, orig, nat, ttl);
+      });
+}
+
+ReplicationPrimary::~ReplicationPrimary() {
+  mapper_->set_event_callback(nullptr);
+  close(socket_fd_);
+  if (!unix_path_.empty()) {
+    unlink(unix_path_.c_str());
+  }
+}
+
+void ReplicationPrimary::Prepare(FdSets &fds) const {
+  fds.WatchRead(socket_fd_);
+  for (const auto &replica : replicas_) {
+    fds.WatchRead(replica.fd());
+    if (replica.write_pending()) {
+      fds.WatchWrite(replica.fd());
+    }
+  }
+}
+
+void ReplicationPrimary::Dispatch(const FdSets &fds) {
+  for (auto it = replicas_.begin(); it != replicas_.end(); ) {
+    try {
+      if (fds.writeable(it->fd())) {
+        it->HandleWriteable(*mapper_);
+      }
+      if (fds.readable(it->fd())) {
+        it->HandleReadable();
+      }
+      ++it;
+    } catch (replica_exception &) {
+      std::clog << "replica disconnected." << std::endl;
+      it = replicas_.erase(it);
+    }
+  }
+
+  if (fds.readable(socket_fd_)) {
+    HandleAccept();
+  }
+}
+
+void ReplicationPrimary::Tick() {
+  if (!replicas_.empty()) {
+    SendTouches();
+  }
+  char record[kRecordSize];
+  EncodeRecord(record, kHeartbeat, head_seq_);
+  Broadcast(record);
+  if (lag() > max_lag_ / 2) {
+    std::clog << "replication lag is " << lag() << " records." << std::endl;
+  }
+}
+
+std::uint64_t ReplicationPrimary::lag() const {
+  std::uint64_t max = 0;
+  for (const auto &replica : replicas_) {
+    max = std::max(max, head_seq_ - replica.acked_seq());
+  }
+  return max;
+}
+
+void ReplicationPrimary::HandleAccept() {
+  errno = 0;
+  // XXX unportable code.
+  int fd = accept4(socket_fd_, NULL, NULL, SOCK_NONBLOCK);
+  if (fd < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+      throw std::runtime_error("accept failed.");
+    }
+    return;
+  }
+  replicas_.emplace_back(fd, head_seq_, mapper_->TakeSnapshot());
+  std::clog << "replica connected, sending snapshot of "
+            << mapper_->mapped_count() << " mappings." << std::endl;
+}
+
+void ReplicationPrimary::Append(MapperEvent event, const Endpoint &orig,
+                                const Endpoint &nat,
+                                std::chrono::system_clock::duration ttl) {
+  RecordType type;
+  switch (event) {
+    case MapperEvent::kMap:
+      type = kMap;
+      break;
+    case MapperEvent::kUnmap:
+      type = kUnmap;
+      break;
+    case MapperEvent::kExpire:
+      type = kExpire;
+      break;
+    default:
+      return;
+  }
+  char record[kRecordSize];
+  EncodeRecord(record, type, ++head_seq_, orig, nat, ttl);
+  Broadcast(record);
+}
+
+void ReplicationPrimary::SendTouches() {
+  const auto now = MapperClock::now();
+  char record[kRecordSize];
+  mapper_->ForEachMapping(
+      [&](const Endpoint &orig, const Endpoint &nat,
+          std::chrono::system_clock::time_point last_access,
+          std::chrono::system_clock::duration ttl) {
+        if (last_access >= touched_since_) {
+          EncodeRecord(record, kTouch, head_seq_, orig, nat, ttl,
+                       now - last_access);
+          Broadcast(record);
+        }
+      });
+  touched_since_ = now;
+}
+
+void ReplicationPrimary::Broadcast(const char *record) {
+  for (auto it = replicas_.begin(); it != replicas_.end(); ) {
+    if (head_seq_ - it->acked_seq() > max_lag_) {
+      // The replica will reconnect and catch up from a fresh snapshot.
+      std::clog << "dropping replica lagging by "
+                << head_seq_ - it->acked_seq() << " records." << std::endl;
+      it = replicas_.erase(it);
+    } else {
+      it->Append(record, kRecordSize);
+      ++it;
+    }
+  }
+}
+
+ReplicationPrimary::Replica::Replica(
+    int fd, std::uint64_t snapshot_seq,
+    const std::shared_ptr<Mapper::Snapshot> &snapshot)
+    : fd_(fd), out_offset_(0), snapshot_(snapshot),
+      snapshot_seq_(snapshot_seq), in_length_(0), acked_seq_(snapshot_seq) {
+  char record[kRecordSize];
+  EncodeRecord(record, kSnapshotBegin, snapshot_seq_);
+  out_.assign(record, kRecordSize);
+}
+
+ReplicationPrimary::Replica::Replica(Replica &&o)
+    : fd_(std::move(o.fd_)), out_(std::move(o.out_)),
+      out_offset_(std::move(o.out_offset_)),
+      snapshot_(std::move(o.snapshot_)), snapshot_seq_(o.snapshot_seq_),
+      held_(std::move(o.held_)), in_length_(std::move(o.in_length_)),
+      acked_seq_(std::move(o.acked_seq_)) {
+  memcpy(in_, o.in_, sizeof(in_));
+  o.fd_ = -1;
+}
+
+auto ReplicationPrimary::Replica::operator=(Replica &&o) -> Replica & {
+  if (this != &o) {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+    fd_ = std::move(o.fd_);
+    out_ = std::move(o.out_);
+    out_offset_ = std::move(o.out_offset_);
+    snapshot_ = std::move(o.snapshot_);
+    snapshot_seq_ = o.snapshot_seq_;
+    held_ = std::move(o.held_);
+    memcpy(in_, o.in_, sizeof(in_));
+    in_length_ = std::move(o.in_length_);
+    acked_seq_ = std::move(o.acked_seq_);
+    o.fd_ = -1;
+  }
+  return *this;
+}
+
+ReplicationPrimary::Replica::~Replica() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+void ReplicationPrimary::Replica::Append(const char *data,
+                                         std::size_t length) {
+  if (snapshot_) {
+    held_.append(data, length);
+    return;
+  }
+  if (out_offset_ == out_.size()) {
+    out_.clear();
+    out_offset_ = 0;
+  }
+  out_.append(data, length);
+}
+
+void ReplicationPrimary::Replica::HandleReadable() {
+  errno = 0;
+  ssize_t res = read(fd_, in_ + in_length_, sizeof(in_) - in_length_);
+  if (res > 0) {
+    in_length_ += static_cast<std::size_t>(res);
+    if (in_length_ == sizeof(in_)) {
+      acked_seq_ = std::max(acked_seq_, DecodeSeq(in_));
+      in_length_ = 0;
+    }
+  } else if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+    throw replica_exception();
+  }
+}
+
+void ReplicationPrimary::Replica::HandleWriteable(Mapper &mapper) {
+  assert(write_pending());
+  if (out_offset_ == out_.size()) {
+    ContinueSnapshot(mapper);
+    if (out_.empty()) {
+      return;
+    }
+  }
+  errno = 0;
+  ssize_t res = send(fd_, out_.data() + out_offset_,
+                     out_.size() - out_offset_, MSG_NOSIGNAL);
+  if (res >= 0) {
+    out_offset_ += static_cast<std::size_t>(res);
+    if (out_offset_ == out_.size()) {
+      out_.clear();
+      out_offset_ = 0;
+    }
+  } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    throw replica_exception();
+  }
+}
+
+void ReplicationPrimary::Replica::ContinueSnapshot(Mapper &mapper) {
+  out_.clear();
+  out_offset_ = 0;
+  const auto now = MapperClock::now();
+  char record[kRecordSize];
+  mapper.ReadSnapshot(
+      *snapshot_,
+      [&](const Endpoint &orig, const Endpoint &nat,
+          std::chrono::system_clock::time_point last_access,
+          std::chrono::system_clock::duration ttl) {
+        EncodeRecord(record, kMap, snapshot_seq_, orig, nat, ttl,
+                     now - last_access);
+        out_.append(record, kRecordSize);
+      });
+  if (snapshot_->done()) {
+    snapshot_.reset();
+    EncodeRecord(record, kSnapshotEnd, snapshot_seq_);
+    out_.append(record, kRecordSize);
+    out_ += held_;
+    held_.clear();
+  }
+}
+
+ReplicationReplica::ReplicationReplica(const std::shared_ptr<Mapper> &mapper,
+                                       const std::string &primary_spec)
+    : mapper_(mapper), primary_spec_(primary_spec), socket_fd_(-1),
+      synced_(false), applied_seq_(0), failed_resyncs_(0),
+      primary_lost_(false) {
+  if (!Connect()) {
+    throw std::runtime_error("cannot connect to primary.");
+  }
+  last_heard_ = connected_at_;
+}
+
+ReplicationReplica::~ReplicationReplica() {
+  Disconnect();
+}
+
+void ReplicationReplica::Prepare(FdSets &fds) const {
+  if (connected()) {
+    fds.WatchRead(socket_fd_);
+  }
+}
+
+void ReplicationReplica::Dispatch(const FdSets &fds) {
+  if (!connected() || !fds.readable(socket_fd_)) {
+    return;
+  }
+  char buf[64 * kRecordSize];
+  errno = 0;
+  ssize_t res = read(socket_fd_, buf, sizeof(buf));
+  if (res <= 0) {
+    if (res == 0 || errno != EINTR) {
+      std::clog << "lost connection to primary." << std::endl;
+      Disconnect();
+    }
+    return;
+  }
+  last_heard_ = std::chrono::steady_clock::now();
+  failed_resyncs_ = 0;
+  in_.append(buf, static_cast<std::size_t>(res));
+  const std::size_t count = in_.size() / kRecordSize;
+  try {
+    Apply(in_.data(), count);
+  } catch (std::runtime_error &e) {
+    std::clog << "cannot apply replication log: " << e.what() << std::endl;
+    Disconnect();
+    return;
+  }
+  in_.erase(0, count * kRecordSize);
+}
+
+void ReplicationReplica::Tick() {
+  if (primary_lost_) {
+    return;
+  }
+  const auto now = std::chrono::steady_clock::now();
+  if (connected()) {
+    if (last_heard_ >= connected_at_) {
+      if (now - last_heard_ <= kPrimaryTimeout) {
+        return;
+      }
+    } else if (now - connected_at_ <= kResyncTimeout) {
+      return;
+    } else {
+      // E.g. a hung primary whose kernel still accepts connections.
+      ++failed_resyncs_;
+    }
+    std::clog << "primary timed out." << std::endl;
+    Disconnect();
+  }
+  if (failed_resyncs_ > 0 && now - last_heard_ > kPrimaryTimeout) {
+    primary_lost_ = true;
+    PauseAging(now - last_heard_);
+    return;
+  }
+  if (Connect()) {
+    std::clog << "reconnected to primary, resyncing." << std::endl;
+  } else {
+    ++failed_resyncs_;
+  }
+}
+
+std::chrono::steady_clock::duration ReplicationReplica::lag() const {
+  return std::chrono::steady_clock::now() - last_heard_;
+}
+
+bool ReplicationReplica::Connect() {
+  assert(!connected());
+  socket_fd_ = ConnectTo(primary_spec_);
+  if (socket_fd_ < 0) {
+    return false;
+  }
+  in_.clear();
+  synced_ = false;
+  connected_at_ = std::chrono::steady_clock::now();
+  return true;
+}
+
+void ReplicationReplica::Disconnect() {
+  if (socket_fd_ >= 0) {
+    close(socket_fd_);
+    socket_fd_ = -1;
+  }
+}
+
+void ReplicationReplica::Apply(const char *records, std::size_t count) {
+  const std::uint64_t prev_seq = applied_seq_;
+  mapper_->BeginBatch();
+  try {
+    for (std::size_t i = 0; i < count; ++i) {
+      const char *record = records + i * kRecordSize;
+      std::uint64_t seq = DecodeSeq(record + 4);
+      const auto endpoints = DecodeEndpoints(record);
+      std::uint32_t ttl_sec;
+      memcpy(&ttl_sec, record + 20, sizeof(ttl_sec));
+      const std::chrono::seconds ttl(ntohl(ttl_sec));
+      std::uint32_t age_sec;
+      memcpy(&age_sec, record + 28, sizeof(age_sec));
+      const auto last_access =
+          MapperClock::now() - std::chrono::seconds(ntohl(age_sec));
+      switch (static_cast<unsigned char>(record[0])) {
+        case kSnapshotBegin:
+          synced_ = false;
+          mapper_->Clear();
+          break;
+        case kSnapshotEnd:
+          synced_ = true;
+          std::clog << "replica synced " << mapper_->mapped_count()
+                    << " mappings." << std::endl;
+          break;
+        case kMap:
+        case kTouch:
+          mapper_->Insert(endpoints.first, endpoints.second, last_access,
+                          ttl);
+          break;
+        case kUnmap:
+        case kExpire:
+          mapper_->Erase(endpoints.first);
+          break;
+        case kHeartbeat:
+          break;
+        default:
+          throw std::runtime_error("unknown replication record.");
+      }
+      applied_seq_ = seq;
+    }
+  } catch (...) {
+    mapper_->CommitBatch();
+    throw;
+  }
+  mapper_->CommitBatch();
+  if (applied_seq_ != prev_seq) {
+    SendAck();
+  }
+}
+
+void ReplicationReplica::PauseAging(
+    std::chrono::steady_clock::duration silence) {
+  struct Mapping {
+    Endpoint orig;
+    Endpoint nat;
+    std::chrono::system_clock::time_point last_access;
+    std::chrono::system_clock::duration ttl;
+  };
+  const auto now = MapperClock::now();
+  const auto shift =
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(silence);
+  std::vector<Mapping> mappings;
+  mappings.reserve(mapper_->mapped_count());
+  mapper_->ForEachMapping(
+      [&](const Endpoint &orig, const Endpoint &nat,
+          std::chrono::system_clock::time_point last_access,
+          std::chrono::system_clock::duration ttl) {
+        mappings.push_back({orig, nat, std::min(last_access + shift, now),
+                            ttl});
+      });
+  for (const auto &mapping : mappings) {
+    mapper_->Insert(mapping.orig, mapping.nat, mapping.last_access,
+                    mapping.ttl);
+  }
+}
+
+void ReplicationReplica::SendAck() {
+  char ack[8];
+  EncodeSeq(ack, applied_seq_);
+  if (send(socket_fd_, ack, sizeof(ack), MSG_NOSIGNAL) != sizeof(ack)) {
+    std::clog << "cannot acknowledge replication log." << std::endl;
+    Disconnect();
+  }
+}
+
+} // namespace ipremapd
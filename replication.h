@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IPREMAPD_REPLICATION_H_
+#define IPREMAPD_REPLICATION_H_
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "fd_sets.h"
+#include "mapper.h"
+
+namespace ipremapd {
+
+// Socket specifications are either a Unix socket path (anything containing
+// a slash) or a TCP host:port pair.
+
+// Streams the ordered log of mapping changes to replicas. A freshly
+// connected replica first receives a snapshot of the whole table, read a
+// few buckets per round, then the log tail from the sequence number the
+// snapshot was taken at. Every tick also reports the mappings used since
+// the previous one, so that replicas expire them as the primary does.
+class ReplicationPrimary {
+ public:
+  static constexpr std::uint64_t kDefaultMaxLag = 65536;
+
+  ReplicationPrimary(const std::shared_ptr<Mapper> &mapper,
+                     const std::string &listen_spec,
+                     std::uint64_t max_lag = kDefaultMaxLag);
+  ReplicationPrimary(const ReplicationPrimary &) = delete;
+  ReplicationPrimary &operator=(const ReplicationPrimary &) = delete;
+  ~ReplicationPrimary();
+
+  void Prepare(FdSets &fds) const;
+  void Dispatch(const FdSets &fds);
+  // Sends touched mappings and heartbeats, which replicas use to detect a
+  // dead primary.
+  void Tick();
+
+  std::size_t replica_count() const { return replicas_.size(); }
+  // Largest number of log records not yet acknowledged by a replica.
+  std::uint64_t lag() const;
+
+ private:
+  static constexpr int kBacklogSize = 4;
+
+  class Replica {
+   public:
+    Replica(int fd, std::uint64_t snapshot_seq,
+            const std::shared_ptr<Mapper::Snapshot> &snapshot);
+    Replica(const Replica &) = delete;
+    Replica(Replica &&);
+    Replica &operator=(const Replica &) = delete;
+    Replica &operator=(Replica &&);
+    ~Replica();
+
+    int fd() const { return fd_; }
+    bool write_pending() const {
+      return out_offset_ < out_.size() || snapshot_;
+    }
+    std::uint64_t acked_seq() const { return acked_seq_; }
+
+    // Holds records back while the snapshot is being sent.
+    void Append(const char *data, std::size_t length);
+    void HandleReadable();
+    void HandleWriteable(Mapper &mapper);
+
+   private:
+    // Reads the next part of the snapshot into out_, followed by the held
+    // back log once it is done.
+    void ContinueSnapshot(Mapper &mapper);
+
+    int fd_;
+    std::string out_;
+    std::size_t out_offset_;
+    std::shared_ptr<Mapper::Snapshot> snapshot_;
+    std::uint64_t snapshot_seq_;
+    std::string held_;
+    char in_[8];
+    std::size_t in_length_;
+    std::uint64_t acked_seq_;
+  };
+
+  void HandleAccept();
+  void Append(MapperEvent event, const Endpoint &orig, const Endpoint &nat,
+              std::chrono::system_clock::duration ttl);
+  void Broadcast(const char *record);
+  void SendTouches();
+
+  std::shared_ptr<Mapper> mapper_;
+  std::string unix_path_;
+  int socket_fd_;
+  std::uint64_t max_lag_;
+  std::uint64_t head_seq_;
+  // Mappings used since are sent by the next tick.
+  std::chrono::system_clock::time_point touched_since_;
+  std::vector<Replica> replicas_;
+};
+
+// Follows a primary, applying its log to the local mapper in batches. The
+// replica reconnects and resyncs from a fresh snapshot whenever it loses
+// the connection, and only gives up on the primary once it has heard
+// nothing from it for a while, reconnection attempts included.
+class ReplicationReplica {
+ public:
+  ReplicationReplica(const std::shared_ptr<Mapper> &mapper,
+                     const std::string &primary_spec);
+  ReplicationReplica(const ReplicationReplica &) = delete;
+  ReplicationReplica &operator=(const ReplicationReplica &) = delete;
+  ~ReplicationReplica();
+
+  void Prepare(FdSets &fds) const;
+  void Dispatch(const FdSets &fds);
+  // Disconnects if the primary has been silent for too long, and
+  // reconnects.
+  void Tick();
+
+  bool connected() const { return socket_fd_ >= 0; }
+  // Whether the primary is presumed dead, so the replica should take over.
+  bool primary_lost() const { return primary_lost_; }
+  bool synced() const { return synced_; }
+  std::uint64_t applied_seq() const { return applied_seq_; }
+  // Time since the last message from the primary.
+  std::chrono::steady_clock::duration lag() const;
+
+ private:
+  bool Connect();
+  void Disconnect();
+  void Apply(const char *records, std::size_t count);
+  // Ages the mappings as if no time had passed during silence, since the
+  // primary may have used them without telling.
+  void PauseAging(std::chrono::steady_clock::duration silence);
+  void SendAck();
+
+  std::shared_ptr<Mapper> mapper_;
+  std::string primary_spec_;
+  int socket_fd_;
+  std::string in_;
+  bool synced_;
+  std::uint64_t applied_seq_;
+  std::chrono::steady_clock::time_point last_heard_;
+  std::chrono::steady_clock::time_point connected_at_;
+  // Reconnection attempts since last_heard_ that failed, or that the
+  // primary did not answer.
+  unsigned failed_resyncs_;
+  bool primary_lost_;
+};
+
+} // namespace ipremapd
+
+#endif // IPREMAPD_REPLICATION_H_
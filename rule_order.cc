@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rule_order.h"
+
+#include <algorithm>
+
+namespace ipremapd {
+
+static int Band(std::uint64_t packets) {
+  int band = 0;
+  while (packets != 0) {
+    packets >>= 1;
+    ++band;
+  }
+  return band;
+}
+
+std::vector<std::size_t> HotFirstOrder(
+    const std::vector<std::uint64_t> &packets) {
+  std::vector<std::size_t> order(packets.size());
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&packets](std::size_t a, std::size_t b) {
+                     return Band(packets[a]) > Band(packets[b]);
+                   });
+  return order;
+}
+
+std::vector<bool> RulesToMove(const std::vector<std::size_t> &order) {
+  // Longest increasing subsequence of chain positions in the planned
+  // order: tails[k] ends the best run of length k + 1 found so far.
+  std::vector<std::size_t> tails;
+  std::vector<std::size_t> tail_at;
+  std::vector<std::size_t> prev(order.size());
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    auto it = std::lower_bound(tails.begin(), tails.end(), order[i]);
+    const std::size_t length = static_cast<std::size_t>(it - tails.begin());
+    prev[i] = length > 0 ? tail_at[length - 1] : order.size();
+    if (it == tails.end()) {
+      tails.push_back(order[i]);
+      tail_at.push_back(i);
+    } else {
+      *it = order[i];
+      tail_at[length] = i;
+    }
+  }
+  std::vector<bool> move(order.size(), true);
+  if (!tail_at.empty()) {
+    for (std::size_t i = tail_at.back(); i != order.size(); i = prev[i]) {
+      move[order[i]] = false;
+    }
+  }
+  return move;
+}
+
+double AverageEvaluations(const std::vector<std::uint64_t> &packets,
+                          const std::vector<std::size_t> &order) {
+  double evaluations = 0;
+  double total = 0;
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    evaluations += static_cast<double>(packets[order[i]]) * (i + 1);
+    total += static_cast<double>(packets[order[i]]);
+  }
+  return total > 0 ? evaluations / total : 0;
+}
+
+} // namespace ipremapd
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IPREMAPD_RULE_ORDER_H_
+#define IPREMAPD_RULE_ORDER_H_
+
+#include <cstdint>
+#include <vector>
+
+// Plans moving the busiest rules of a chain to its top, given the packets
+// each rule matched recently, in chain order.
+//
+// Rules are ranked in bands of powers of two of their packet counts, and
+// rules in the same band keep their relative order, so that noise does
+// not shuffle the chain. Of the rest, only rules off the longest run that
+// is already in the planned order move.
+
+namespace ipremapd {
+
+// Returns the planned order as indices into packets.
+std::vector<std::size_t> HotFirstOrder(
+    const std::vector<std::uint64_t> &packets);
+
+// Returns whether each rule, in chain order, moves to reach order.
+std::vector<bool> RulesToMove(const std::vector<std::size_t> &order);
+
+// The average number of rules a packet is matched against with the rules
+// in order, one for a packet matching the first rule.
+double AverageEvaluations(const std::vector<std::uint64_t> &packets,
+                          const std::vector<std::size_t> &order);
+
+} // namespace ipremapd
+
+#endif // IPREMAPD_RULE_ORDER_H_
@@ -29,9 +29,10 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <sys/un.h>
 
+#include "basic_mapper.h"
+
 #ifndef UNIX_PATH_MAX
 // man 7 unix says UNIX_PATH_MAX should be defined, but it isn't.
 #define UNIX_PATH_MAX sizeof(std::declval<sockaddr_un>().sun_path)
@@ -39,6 +40,8 @@
 
 namespace ipremapd {
 
+constexpr std::size_t Server::kMaxResponseSize;
+
 namespace {
 
 // Anonymous namespace silences clang++ -Wweak-vtables
@@ -46,17 +49,23 @@ namespace {
 class connection_exception : public std::exception {
 };
 
+// In network byte order.
+std::uint32_t TtlSeconds(std::chrono::system_clock::duration ttl) {
+  return htonl(static_cast<std::uint32_t>(
+      std::chrono::duration_cast<std::chrono::seconds>(ttl).count()));
+}
+
 } // namespace
 
-Server::Server(const std::shared_ptr<Mapper> &mapper,
-               const std::string &socket_path)
-    : mapper_(std::move(mapper)), socket_path_(socket_path) {
+Server::Server(const std::string &socket_path)
+    : socket_path_(socket_path),
+      draining_(false), next_client_(0) {
   if (socket_path.length() >= UNIX_PATH_MAX) {
     throw std::invalid_argument("path too long.");
   }
 
   // XXX unportable code.
-  max_fd_ = socket_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+  socket_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
   if (socket_fd_ < 0) {
     throw std::runtime_error("socket failed.");
   }
@@ -77,20 +86,33 @@ Server::Server(const std::shared_ptr<Mapper> &mapper,
   connections_.reserve(kBacklogSize);
 }
 
+Server::Server(const std::string &socket_path, int socket_fd,
+               const std::vector<ConnectionState> &connections)
+    : socket_path_(socket_path), socket_fd_(socket_fd),
+      draining_(false), next_client_(0) {
+  connections_.reserve(std::max<std::size_t>(kBacklogSize,
+                                             connections.size()));
+  for (const auto &state : connections) {
+    connections_.emplace_back(state, next_client_++);
+  }
+}
+
 Server::Server(Server &&o)
-    : mapper_(std::move(o.mapper_)), socket_path_(std::move(o.socket_path_)),
-      socket_fd_(std::move(o.socket_fd_)), max_fd_(std::move(o.max_fd_)),
-      connections_(std::move(o.connections_)) {
+    : socket_path_(std::move(o.socket_path_)),
+      socket_fd_(std::move(o.socket_fd_)), draining_(std::move(o.draining_)),
+      connections_(std::move(o.connections_)), trace_(std::move(o.trace_)),
+      next_client_(o.next_client_) {
   o.socket_fd_ = -1;
 }
 
 Server &Server::operator=(Server &&o) {
   if (this != &o) {
-    mapper_ = std::move(o.mapper_);
     socket_path_ = std::move(o.socket_path_);
     socket_fd_ = std::move(o.socket_fd_);
-    max_fd_ = std::move(o.max_fd_);
+    draining_ = std::move(o.draining_);
     connections_ = std::move(o.connections_);
+    trace_ = std::move(o.trace_);
+    next_client_ = o.next_client_;
     o.socket_fd_ = -1;
   }
   return *this;
@@ -99,47 +121,41 @@ Server &Server::operator=(Server &&o) {
 Server::~Server() {
   if (socket_fd_ >= 0) {
     close(socket_fd_);
-    unlink(socket_path_.c_str());
+    if (!socket_path_.empty()) {
+      unlink(socket_path_.c_str());
+    }
   }
 }
 
-void Server::Select(timeval *timeout) {
-  fd_set readfds, writefds, exceptfds;
-  FD_ZERO(&readfds);
-  FD_ZERO(&writefds);
-  FD_ZERO(&exceptfds);
-  FD_SET(socket_fd_, &readfds);
-  FD_SET(socket_fd_, &exceptfds);
+void Server::Prepare(FdSets &fds) const {
+  if (!draining_) {
+    fds.WatchRead(socket_fd_);
+  }
+  fds.WatchExcept(socket_fd_);
   for (const auto &conn : connections_) {
-    FD_SET(conn.fd(), &exceptfds);
+    fds.WatchExcept(conn.fd());
     if (conn.write_pending()) {
-      FD_SET(conn.fd(), &writefds);
-    } else {
-      FD_SET(conn.fd(), &readfds);
-    }
-  }
-
-  errno = 0;
-  if (select(max_fd_ + 1, &readfds, &writefds, &exceptfds, timeout) < 0) {
-    if (errno == EINTR) {
-      return;
-    } else {
-      throw std::runtime_error("select failed.");
+      fds.WatchWrite(conn.fd());
+    } else if (!draining_) {
+      fds.WatchRead(conn.fd());
     }
   }
+}
 
-  if (FD_ISSET(socket_fd_, &exceptfds)) {
+template <typename M>
+void Server::Dispatch(M &mapper, const FdSets &fds) {
+  if (fds.has_exception(socket_fd_)) {
     throw std::runtime_error("exception on server socket.");
   }
 
   for (auto it = connections_.begin(); it != connections_.end(); ) {
     try {
-      if (FD_ISSET(it->fd(), &exceptfds)) {
+      if (fds.has_exception(it->fd())) {
         throw connection_exception();
-      } else if (FD_ISSET(it->fd(), &writefds)) {
+      } else if (fds.writeable(it->fd())) {
         it->HandleWriteable();
-      } else if (FD_ISSET(it->fd(), &readfds)) {
-        it->HandleReadable(*mapper_);
+      } else if (fds.readable(it->fd())) {
+        it->HandleReadable(mapper, trace_.get());
       }
       ++it;
     } catch (connection_exception &) {
@@ -147,18 +163,33 @@ void Server::Select(timeval *timeout) {
     }
   }
 
-  if (FD_ISSET(socket_fd_, &readfds)) {
+  if (fds.readable(socket_fd_)) {
     HandleAccept();
   }
 }
 
+bool Server::drained() const {
+  return std::none_of(connections_.cbegin(), connections_.cend(),
+                      [](const Connection &conn) {
+                        return conn.write_pending();
+                      });
+}
+
+auto Server::connection_states() const -> std::vector<ConnectionState> {
+  std::vector<ConnectionState> states;
+  states.reserve(connections_.size());
+  for (const auto &conn : connections_) {
+    states.push_back({conn.fd(), conn.write_pending(), conn.response()});
+  }
+  return states;
+}
+
 void Server::HandleAccept() {
   errno = 0;
   // XXX unportable code.
   int fd = accept4(socket_fd_, NULL, NULL, SOCK_NONBLOCK);
   if (fd >= 0) {
-    max_fd_ = std::max(max_fd_, fd);
-    connections_.emplace_back(fd);
+    connections_.emplace_back(fd, next_client_++);
   } else {
     if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
       throw std::runtime_error("accept failed.");
@@ -166,21 +197,32 @@ void Server::HandleAccept() {
   }
 }
 
-Server::Connection::Connection(int fd)
-    : fd_(fd), write_pending_(false) {
+Server::Connection::Connection(int fd, std::uint32_t client)
+    : fd_(fd), client_(client), write_pending_(false), response_length_(0) {
+}
+
+Server::Connection::Connection(const ConnectionState &state,
+                               std::uint32_t client)
+    : fd_(state.fd), client_(client), write_pending_(state.write_pending),
+      response_length_(std::min(state.response.size(), kMaxResponseSize)) {
+  memcpy(response_, state.response.data(), response_length_);
 }
 
 Server::Connection::Connection(Connection &&o)
-    : fd_(std::move(o.fd_)), write_pending_(std::move(o.write_pending_)),
-      response_(std::move(o.response_)) {
+    : fd_(std::move(o.fd_)), client_(o.client_),
+      write_pending_(std::move(o.write_pending_)),
+      response_length_(std::move(o.response_length_)) {
+  memcpy(response_, o.response_, response_length_);
   o.fd_ = -1;
 }
 
 auto Server::Connection::operator=(Connection &&o) -> Connection & {
   if (this != &o) {
     fd_ = std::move(o.fd_);
+    client_ = o.client_;
     write_pending_ = std::move(o.write_pending_);
-    response_ = std::move(o.response_);
+    response_length_ = std::move(o.response_length_);
+    memcpy(response_, o.response_, response_length_);
     o.fd_ = -1;
   }
   return *this;
@@ -192,13 +234,45 @@ Server::Connection::~Connection() {
   }
 }
 
-void Server::Connection::HandleReadable(Mapper &mapper) {
-  in_addr request;
+template <typename M>
+void Server::Connection::HandleReadable(M &mapper, TraceWriter *trace) {
+  // One spare byte tells oversized requests apart.
+  char request[sizeof(ipremap_port_request) + 1];
   errno = 0;
-  ssize_t res = read(fd_, &request, sizeof(request));
-  if (res == sizeof(request)) {
-    in_addr nat_addr = mapper.Map(request);
-    SetResponse(nat_addr);
+  ssize_t res = read(fd_, request, sizeof(request));
+  if (res == sizeof(in_addr)) {
+    in_addr orig_addr;
+    memcpy(&orig_addr, request, sizeof(orig_addr));
+    Trace(trace, TraceRequest::kLegacy, 0, orig_addr,
+          std::chrono::seconds::zero());
+    if (mapper.Accepts(orig_addr)) {
+      SetResponse(mapper.Map(orig_addr).addr);
+    } else {
+      SetInvalidResponse();
+    }
+  } else if (res == sizeof(ipremap_request)) {
+    ipremap_request lease_request;
+    memcpy(&lease_request, request, sizeof(lease_request));
+    const std::chrono::seconds ttl(ntohl(lease_request.ttl));
+    Trace(trace, TraceRequest::kLease, lease_request.op, lease_request.addr,
+          ttl);
+    Endpoint nat;
+    std::chrono::system_clock::duration granted_ttl;
+    ipremap_status status = HandleRequest(
+        mapper, lease_request.op, ttl, lease_request.addr, &nat, &granted_ttl);
+    SetResponse(status, nat.addr, granted_ttl);
+  } else if (res == sizeof(ipremap_port_request)) {
+    ipremap_port_request port_request;
+    memcpy(&port_request, request, sizeof(port_request));
+    const std::chrono::seconds ttl(ntohl(port_request.ttl));
+    const Endpoint orig(port_request.addr, ntohs(port_request.port),
+                        port_request.proto);
+    Trace(trace, TraceRequest::kPort, port_request.op, orig, ttl);
+    Endpoint nat;
+    std::chrono::system_clock::duration granted_ttl;
+    ipremap_status status = HandleRequest(
+        mapper, port_request.op, ttl, orig, &nat, &granted_ttl);
+    SetPortResponse(status, nat, granted_ttl);
   } else if (res > 0) {
     SetInvalidResponse();
   } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
@@ -209,23 +283,67 @@ void Server::Connection::HandleReadable(Mapper &mapper) {
 void Server::Connection::HandleWriteable() {
   assert(write_pending_);
   errno = 0;
-  ssize_t ret = write(fd_, &response_, sizeof(response_));
-  if (ret == sizeof(response_)) {
+  ssize_t ret = write(fd_, response_, response_length_);
+  if (ret == static_cast<ssize_t>(response_length_)) {
     write_pending_ = false;
   } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
     throw connection_exception();
   }
 }
 
+void Server::Connection::Trace(TraceWriter *trace, TraceRequest request,
+                               std::uint8_t op, const Endpoint &orig,
+                               std::chrono::seconds ttl) const {
+  if (trace != nullptr) {
+    trace->Record({request, op, std::chrono::system_clock::now(), client_,
+                   orig, ttl});
+  }
+}
+
 void Server::Connection::SetResponse(const in_addr &addr) {
   write_pending_ = true;
-  response_ = addr;
+  memcpy(response_, &addr, sizeof(addr));
+  response_length_ = sizeof(addr);
 }
 
 void Server::Connection::SetInvalidResponse() {
-  write_pending_ = true;
   // XXX we assume a zero in_addr doesn't represent any valid address.
-  memset(&response_, 0, sizeof(response_));   
+  in_addr addr;
+  memset(&addr, 0, sizeof(addr));
+  SetResponse(addr);
+}
+
+void Server::Connection::SetResponse(
+    ipremap_status status, const in_addr &addr,
+    std::chrono::system_clock::duration ttl) {
+  ipremap_response response;
+  memset(&response, 0, sizeof(response));
+  response.status = static_cast<std::uint8_t>(status);
+  response.ttl = TtlSeconds(ttl);
+  response.addr = addr;
+  write_pending_ = true;
+  memcpy(response_, &response, sizeof(response));
+  response_length_ = sizeof(response);
 }
 
+void Server::Connection::SetPortResponse(
+    ipremap_status status, const Endpoint &nat,
+    std::chrono::system_clock::duration ttl) {
+  ipremap_port_response response;
+  memset(&response, 0, sizeof(response));
+  response.status = static_cast<std::uint8_t>(status);
+  response.ttl = TtlSeconds(ttl);
+  response.addr = nat.addr;
+  response.port = htons(nat.port);
+  write_pending_ = true;
+  memcpy(response_, &response, sizeof(response));
+  response_length_ = sizeof(response);
+}
+
+template void Server::Dispatch(BasicMapper<LruPolicy> &, const FdSets &);
+template void Server::Dispatch(BasicMapper<ClockPolicy> &, const FdSets &);
+template void Server::Dispatch(BasicMapper<TtlOnlyPolicy> &, const FdSets &);
+template void Server::Dispatch(BasicMapper<FrequencyPolicy> &,
+                               const FdSets &);
+
 } // namespace ipremapd
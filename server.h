@@ -21,35 +21,93 @@
 #define IPREMAPD_SERVER_H_
 
 #include <chrono>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
 
 #include <arpa/inet.h>
-#include <sys/time.h>
 
-#include "mapper.h"
+#include "fd_sets.h"
+#include "endpoint.h"
+#include "protocol.h"
+#include "trace.h"
 
 namespace ipremapd {
 
+// Serves a lease or port request for orig on a BasicMapper. Trace replay
+// calls it, too.
+template <typename M>
+ipremap_status HandleRequest(
+    M &mapper, std::uint8_t op, std::chrono::seconds ttl,
+    const Endpoint &orig, Endpoint *nat,
+    std::chrono::system_clock::duration *granted_ttl) {
+  *granted_ttl = std::chrono::seconds::zero();
+  if (!mapper.Accepts(orig)) {
+    return IPREMAP_INVALID;
+  }
+  switch (op) {
+    case IPREMAP_MAP:
+      *nat = mapper.Lease(orig, ttl, granted_ttl);
+      return IPREMAP_OK;
+    case IPREMAP_RENEW:
+      return mapper.RenewLease(orig, ttl, nat, granted_ttl)
+          ? IPREMAP_OK : IPREMAP_NOT_MAPPED;
+    case IPREMAP_RELEASE:
+      return mapper.ReleaseLease(orig) ? IPREMAP_OK : IPREMAP_NOT_MAPPED;
+    default:
+      return IPREMAP_INVALID;
+  }
+}
+
 class Server {
  public:
-  Server(const std::shared_ptr<Mapper> &mapper,
-         const std::string &socket_path);
+  static constexpr std::size_t kMaxResponseSize =
+      sizeof(ipremap_port_response);
+
+  struct ConnectionState {
+    int fd;
+    bool write_pending;
+    std::string response;
+  };
+
+  explicit Server(const std::string &socket_path);
+  // Adopts the listening socket and connections of a previous instance.
+  Server(const std::string &socket_path, int socket_fd,
+         const std::vector<ConnectionState> &connections);
   Server(const Server &) = delete;
   Server(Server &&);
   Server &operator=(const Server &) = delete;
   Server &operator=(Server &&);
   ~Server();
 
-  void Select(timeval *timeout);
+  void Prepare(FdSets &fds) const;
+  // Serves requests on mapper, a BasicMapper.
+  template <typename M>
+  void Dispatch(M &mapper, const FdSets &fds);
+
+  // While draining, only pending responses are written.
+  void StartDraining() { draining_ = true; }
+  void Resume() { draining_ = false; }
+  bool drained() const;
+
+  // Records every well-formed request to trace.
+  void set_trace(const std::shared_ptr<TraceWriter> &trace) {
+    trace_ = trace;
+  }
+
+  int socket_fd() const { return socket_fd_; }
+  std::vector<ConnectionState> connection_states() const;
+  // Leaves the socket path in place for a successor.
+  void Release() { socket_path_.clear(); }
 
  private:
   static constexpr int kBacklogSize = 32;
 
   class Connection {
    public:
-    explicit Connection(int fd);
+    Connection(int fd, std::uint32_t client);
+    Connection(const ConnectionState &state, std::uint32_t client);
     Connection(const Connection &) = delete;
     Connection(Connection &&);
     Connection &operator=(const Connection &) = delete;
@@ -58,26 +116,39 @@ class Server {
 
     int fd() const { return fd_; }
     bool write_pending() const { return write_pending_; }
+    std::string response() const {
+      return std::string(response_, response_length_);
+    }
 
-    void HandleReadable(Mapper &mapper);
+    template <typename M>
+    void HandleReadable(M &mapper, TraceWriter *trace);
     void HandleWriteable();
 
    private:
+    void Trace(TraceWriter *trace, TraceRequest request, std::uint8_t op,
+               const Endpoint &orig, std::chrono::seconds ttl) const;
     void SetResponse(const in_addr &addr);
     void SetInvalidResponse();
+    void SetResponse(ipremap_status status, const in_addr &addr,
+                     std::chrono::system_clock::duration ttl);
+    void SetPortResponse(ipremap_status status, const Endpoint &nat,
+                         std::chrono::system_clock::duration ttl);
 
     int fd_;
+    std::uint32_t client_;
     bool write_pending_;
-    in_addr response_;
+    char response_[kMaxResponseSize];
+    std::size_t response_length_;
   };
 
   void HandleAccept();
 
-  std::shared_ptr<Mapper> mapper_;
   std::string socket_path_;
   int socket_fd_;
-  int max_fd_;
+  bool draining_;
   std::vector<Connection> connections_;
+  std::shared_ptr<TraceWriter> trace_;
+  std::uint32_t next_client_;
 };
 
 } // namespace ipremapd
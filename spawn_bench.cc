@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares the latency of running a trivial command by forking the calling
+// process against going through a Spawner, as the caller's RSS grows.
+//
+// usage: spawn_bench [ITERATIONS [MIB...]]
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "spawner.h"
+
+namespace {
+
+const char *kCommand = "/bin/true";
+
+void ForkAndExec() {
+  pid_t pid = fork();
+  if (pid == 0) {
+    execl(kCommand, kCommand, static_cast<char *>(nullptr));
+    _Exit(EXIT_FAILURE);
+  } else if (pid < 0) {
+    throw std::runtime_error("fork failed.");
+  }
+  int status;
+  waitpid(pid, &status, 0);
+}
+
+template <typename F>
+double MicrosecondsPerRun(int iterations, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    f();
+  }
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  using namespace ipremapd;
+
+  int iterations = argc > 1 ? std::atoi(argv[1]) : 200;
+  std::vector<std::size_t> sizes;
+  for (int i = 2; i < argc; ++i) {
+    sizes.push_back(std::strtoul(argv[i], nullptr, 10));
+  }
+  if (sizes.empty()) {
+    sizes = {0, 64, 256, 1024};
+  }
+
+  try {
+    Spawner spawner;
+    std::vector<std::vector<char>> ballast;
+    std::size_t rss = 0;
+
+    std::cout << std::setw(10) << "rss (MiB)" << std::setw(14) << "fork (us)"
+              << std::setw(16) << "spawner (us)" << std::endl;
+    for (std::size_t size : sizes) {
+      if (size > rss) {
+        // Touch every page so that it is actually mapped.
+        ballast.emplace_back((size - rss) << 20, 1);
+        rss = size;
+      }
+      double fork_us = MicrosecondsPerRun(iterations, ForkAndExec);
+      double spawner_us = MicrosecondsPerRun(iterations, [&]() {
+          spawner.Run(kCommand, {});
+        });
+      std::cout << std::setw(10) << rss << std::setw(14) << std::fixed
+                << std::setprecision(1) << fork_us << std::setw(16)
+                << spawner_us << std::endl;
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spawner.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+namespace ipremapd {
+
+namespace {
+
+struct RequestHeader {
+  std::uint32_t argc;
+  // Which descriptors are passed along, in this order.
+  std::uint32_t fds;
+};
+
+constexpr std::uint32_t kInputFd = 1;
+constexpr std::uint32_t kOutputFd = 2;
+
+// Stores the passed descriptors, up to two, in fds and their count in
+// fd_count.
+ssize_t ReceiveRequest(int fd, char *buf, std::size_t length, int *fds,
+                       std::size_t *fd_count) {
+  iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = length;
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  *fd_count = 0;
+  ssize_t res = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  if (res > 0) {
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET
+        && cmsg->cmsg_type == SCM_RIGHTS) {
+      *fd_count = std::min<std::size_t>(
+          (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int), 2);
+      memcpy(fds, CMSG_DATA(cmsg), *fd_count * sizeof(int));
+    }
+  }
+  return res;
+}
+
+pid_t SpawnRequest(const char *buf, std::size_t length, int input_fd,
+                   int output_fd) {
+  RequestHeader header;
+  if (length < sizeof(header)) {
+    return -1;
+  }
+  memcpy(&header, buf, sizeof(header));
+  std::vector<char *> argv;
+  const char *p = buf + sizeof(header);
+  const char *end = buf + length;
+  for (std::uint32_t i = 0; i < header.argc; ++i) {
+    const char *nul = static_cast<const char *>(memchr(p, '\0', end - p));
+    if (nul == nullptr) {
+      return -1;
+    }
+    argv.push_back(const_cast<char *>(p));
+    p = nul + 1;
+  }
+  if (argv.empty()) {
+    return -1;
+  }
+  argv.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (input_fd >= 0) {
+    posix_spawn_file_actions_adddup2(&actions, input_fd, STDIN_FILENO);
+  } else {
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+                                     O_RDONLY, 0);
+  }
+  posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  if (output_fd >= 0) {
+    posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+  } else {
+    posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO, STDOUT_FILENO);
+  }
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGINT);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+  pid_t pid;
+  int res = posix_spawn(&pid, argv[0], &actions, &attr, argv.data(),
+                        environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  return res == 0 ? pid : -1;
+}
+
+void SendReply(int fd, int status) {
+  std::int32_t reply = status;
+  send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+} // namespace
+
+constexpr std::size_t Spawner::kMaxRequestSize;
+
+Spawner::Spawner() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+    throw std::runtime_error("socketpair failed.");
+  }
+  pid_ = fork();
+  if (pid_ == 0) {
+    close(fds[0]);
+    HelperMain(fds[1]);
+  } else if (pid_ < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    throw std::runtime_error("fork failed.");
+  }
+  close(fds[1]);
+  socket_fd_ = fds[0];
+}
+
+Spawner::~Spawner() {
+  // The helper exits once the socket is closed.
+  close(socket_fd_);
+  waitpid(pid_, nullptr, 0);
+}
+
+int Spawner::Run(const std::string &path,
+                 const std::vector<std::string> &args, int input_fd,
+                 int output_fd) {
+  RequestHeader header = {static_cast<std::uint32_t>(args.size() + 1), 0};
+  int fds[2];
+  std::size_t fd_count = 0;
+  if (input_fd >= 0) {
+    header.fds |= kInputFd;
+    fds[fd_count++] = input_fd;
+  }
+  if (output_fd >= 0) {
+    header.fds |= kOutputFd;
+    fds[fd_count++] = output_fd;
+  }
+  std::string request(reinterpret_cast<const char *>(&header),
+                      sizeof(header));
+  request.append(path.c_str(), path.size() + 1);
+  for (const auto &arg : args) {
+    request.append(arg.c_str(), arg.size() + 1);
+  }
+  if (request.size() > kMaxRequestSize) {
+    throw std::invalid_argument("command line too long.");
+  }
+
+  iovec iov;
+  iov.iov_base = const_cast<char *>(request.data());
+  iov.iov_len = request.size();
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  if (fd_count > 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+  }
+  ssize_t res;
+  do {
+    errno = 0;
+    res = sendmsg(socket_fd_, &msg, MSG_NOSIGNAL);
+  } while (res < 0 && errno == EINTR);
+  if (res != static_cast<ssize_t>(request.size())) {
+    throw std::runtime_error("cannot reach spawn helper.");
+  }
+
+  std::int32_t status;
+  do {
+    errno = 0;
+    res = recv(socket_fd_, &status, sizeof(status), 0);
+  } while (res < 0 && errno == EINTR);
+  if (res != sizeof(status)) {
+    throw std::runtime_error("spawn helper died.");
+  }
+  return status;
+}
+
+void Spawner::HelperMain(int fd) {
+  // Interrupting the daemon must not kill commands it is waiting for.
+  signal(SIGINT, SIG_IGN);
+
+  std::vector<char> buf(kMaxRequestSize);
+  for (;;) {
+    int fds[2];
+    std::size_t fd_count;
+    errno = 0;
+    ssize_t length = ReceiveRequest(fd, buf.data(), buf.size(), fds,
+                                    &fd_count);
+    if (length < 0 && errno == EINTR) {
+      continue;
+    } else if (length <= 0) {
+      break;
+    }
+    RequestHeader header;
+    pid_t pid = -1;
+    if (static_cast<std::size_t>(length) >= sizeof(header)) {
+      memcpy(&header, buf.data(), sizeof(header));
+      std::size_t next = 0;
+      int input_fd = -1, output_fd = -1;
+      if ((header.fds & kInputFd) && next < fd_count) {
+        input_fd = fds[next++];
+      }
+      if ((header.fds & kOutputFd) && next < fd_count) {
+        output_fd = fds[next++];
+      }
+      pid = SpawnRequest(buf.data(), static_cast<std::size_t>(length),
+                         input_fd, output_fd);
+    }
+    for (std::size_t i = 0; i < fd_count; ++i) {
+      close(fds[i]);
+    }
+    int status = EXIT_FAILURE << 8;
+    if (pid > 0) {
+      while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+      }
+    }
+    SendReply(fd, status);
+  }
+  _exit(EXIT_SUCCESS);
+}
+
+} // namespace ipremapd
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IPREMAPD_SPAWNER_H_
+#define IPREMAPD_SPAWNER_H_
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace ipremapd {
+
+// Runs commands from a helper process forked while the daemon is still
+// small. Forking the daemon itself would copy page tables that grow with
+// the mapping table. The helper starts commands with posix_spawn and
+// reports their wait statuses back, one command at a time.
+class Spawner {
+ public:
+  Spawner();
+  Spawner(const Spawner &) = delete;
+  Spawner &operator=(const Spawner &) = delete;
+  ~Spawner();
+
+  // Runs path with args, reading standard input from input_fd and
+  // writing standard output to output_fd, or /dev/null if they are
+  // negative. Returns the wait status of the command.
+  int Run(const std::string &path, const std::vector<std::string> &args,
+          int input_fd = -1, int output_fd = -1);
+
+ private:
+  static constexpr std::size_t kMaxRequestSize = 64 * 1024;
+
+  static void HelperMain(int fd);
+
+  int socket_fd_;
+  pid_t pid_;
+};
+
+} // namespace ipremapd
+
+#endif // IPREMAPD_SPAWNER_H_
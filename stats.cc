@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "clock.h"
+
+#ifndef UNIX_PATH_MAX
+// man 7 unix says UNIX_PATH_MAX should be defined, but it isn't.
+#define UNIX_PATH_MAX sizeof(std::declval<sockaddr_un>().sun_path)
+#endif
+
+namespace ipremapd {
+
+namespace {
+
+// Anonymous namespace silences clang++ -Wweak-vtables
+
+class connection_exception : public std::exception {
+};
+
+std::uint32_t Seconds(std::chrono::system_clock::duration duration) {
+  return htonl(static_cast<std::uint32_t>(
+      std::chrono::duration_cast<std::chrono::seconds>(duration).count()));
+}
+
+} // namespace
+
+StatsServer::StatsServer(const std::shared_ptr<Mapper> &mapper,
+                         const std::string &socket_path)
+    : mapper_(mapper), socket_path_(socket_path) {
+  if (socket_path.length() >= UNIX_PATH_MAX) {
+    throw std::invalid_argument("path too long.");
+  }
+
+  // XXX unportable code.
+  socket_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+  if (socket_fd_ < 0) {
+    throw std::runtime_error("socket failed.");
+  }
+  sockaddr_un sa;
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, socket_path.c_str(), UNIX_PATH_MAX);
+  // Left behind by a daemon that did not exit cleanly.
+  unlink(socket_path.c_str());
+  if (bind(socket_fd_, reinterpret_cast<const sockaddr *>(&sa),
+           sizeof(sa)) < 0) {
+    close(socket_fd_);
+    throw std::runtime_error("bind failed.");
+  }
+  if (listen(socket_fd_, kBacklogSize) < 0) {
+    close(socket_fd_);
+    unlink(socket_path_.c_str());
+    throw std::runtime_error("listen failed.");
+  }
+}
+
+StatsServer::StatsServer(const std::shared_ptr<Mapper> &mapper,
+                         const std::string &socket_path, int socket_fd)
+    : mapper_(mapper), socket_path_(socket_path), socket_fd_(socket_fd) {
+}
+
+StatsServer::~StatsServer() {
+  close(socket_fd_);
+  if (!socket_path_.empty()) {
+    unlink(socket_path_.c_str());
+  }
+}
+
+void StatsServer::Prepare(FdSets &fds) const {
+  fds.WatchRead(socket_fd_);
+  fds.WatchExcept(socket_fd_);
+  for (const auto &conn : connections_) {
+    fds.WatchExcept(conn.fd());
+    if (conn.busy()) {
+      fds.WatchWrite(conn.fd());
+    } else {
+      fds.WatchRead(conn.fd());
+    }
+  }
+}
+
+void StatsServer::Dispatch(const FdSets &fds) {
+  if (fds.has_exception(socket_fd_)) {
+    throw std::runtime_error("exception on stats socket.");
+  }
+
+  for (auto it = connections_.begin(); it != connections_.end(); ) {
+    try {
+      if (fds.has_exception(it->fd())) {
+        throw connection_exception();
+      } else if (fds.writeable(it->fd())) {
+        it->HandleWriteable(*mapper_);
+      } else if (fds.readable(it->fd())) {
+        it->HandleReadable(*mapper_);
+      }
+      ++it;
+    } catch (connection_exception &) {
+      it = connections_.erase(it);
+    }
+  }
+
+  if (fds.readable(socket_fd_)) {
+    HandleAccept();
+  }
+}
+
+void StatsServer::HandleAccept() {
+  errno = 0;
+  // XXX unportable code.
+  int fd = accept4(socket_fd_, NULL, NULL, SOCK_NONBLOCK);
+  if (fd >= 0) {
+    connections_.emplace_back(fd);
+  } else {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+      throw std::runtime_error("accept failed.");
+    }
+  }
+}
+
+StatsServer::Connection::Connection(int fd)
+    : fd_(fd), count_(0), ready_(false), filter_(IPREMAP_FILTER_NONE) {
+  memset(&prefix_, 0, sizeof(prefix_));
+  memset(&mask_, 0, sizeof(mask_));
+}
+
+StatsServer::Connection::Connection(Connection &&o)
+    : fd_(o.fd_), out_(std::move(o.out_)), count_(o.count_),
+      ready_(o.ready_), snapshot_(std::move(o.snapshot_)),
+      filter_(o.filter_), prefix_(o.prefix_), mask_(o.mask_) {
+  o.fd_ = -1;
+}
+
+auto StatsServer::Connection::operator=(Connection &&o) -> Connection & {
+  if (this != &o) {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+    fd_ = o.fd_;
+    out_ = std::move(o.out_);
+    count_ = o.count_;
+    ready_ = o.ready_;
+    snapshot_ = std::move(o.snapshot_);
+    filter_ = o.filter_;
+    prefix_ = o.prefix_;
+    mask_ = o.mask_;
+    o.fd_ = -1;
+  }
+  return *this;
+}
+
+StatsServer::Connection::~Connection() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+void StatsServer::Connection::HandleReadable(Mapper &mapper) {
+  // One spare byte tells oversized requests apart.
+  char buf[sizeof(ipremap_stats_request) + 1];
+  errno = 0;
+  ssize_t res = read(fd_, buf, sizeof(buf));
+  if (res <= 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      throw connection_exception();
+    }
+    return;
+  }
+  StartResponse();
+  ipremap_stats_request request;
+  if (res != sizeof(request)) {
+    FinishResponse(IPREMAP_INVALID, false);
+    return;
+  }
+  memcpy(&request, buf, sizeof(request));
+  if (request.op == IPREMAP_LOOKUP) {
+    Endpoint nat(request.addr);
+    if (mapper.pool().port_mode()) {
+      nat.port = ntohs(request.port);
+      nat.proto = request.proto;
+    }
+    auto visitor = [this](const Endpoint &orig, const Endpoint &nat,
+                          std::chrono::system_clock::time_point last_access,
+                          std::chrono::system_clock::duration ttl) {
+      Append(orig, nat, last_access, ttl);
+    };
+    FinishResponse(mapper.ReverseLookup(nat, visitor)
+                   ? IPREMAP_OK : IPREMAP_NOT_MAPPED, false);
+  } else if (request.op == IPREMAP_DUMP
+             && request.filter <= IPREMAP_FILTER_NAT
+             && request.prefix_len <= 32) {
+    filter_ = request.filter;
+    mask_.s_addr = request.prefix_len == 0
+        ? 0 : htonl(~std::uint32_t(0) << (32 - request.prefix_len));
+    prefix_.s_addr = request.addr.s_addr & mask_.s_addr;
+    snapshot_ = mapper.TakeSnapshot();
+  } else {
+    FinishResponse(IPREMAP_INVALID, false);
+  }
+}
+
+void StatsServer::Connection::HandleWriteable(Mapper &mapper) {
+  if (!ready_) {
+    ContinueDump(mapper);
+    return;
+  }
+  errno = 0;
+  ssize_t res = write(fd_, out_.data(), out_.size());
+  if (res == static_cast<ssize_t>(out_.size())) {
+    ready_ = false;
+    if (snapshot_) {
+      StartResponse();
+    }
+  } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    throw connection_exception();
+  }
+}
+
+void StatsServer::Connection::StartResponse() {
+  out_.assign(sizeof(ipremap_stats_header), '\0');
+  count_ = 0;
+}
+
+void StatsServer::Connection::Append(
+    const Endpoint &orig, const Endpoint &nat,
+    std::chrono::system_clock::time_point last_access,
+    std::chrono::system_clock::duration ttl) {
+  ipremap_mapping mapping;
+  memset(&mapping, 0, sizeof(mapping));
+  mapping.orig_addr = orig.addr;
+  mapping.nat_addr = nat.addr;
+  mapping.orig_port = htons(orig.port);
+  mapping.nat_port = htons(nat.port);
+  mapping.proto = orig.proto;
+  mapping.age = Seconds(std::max(MapperClock::now() - last_access,
+                                 std::chrono::system_clock::duration::zero()));
+  mapping.ttl = Seconds(ttl);
+  out_.append(reinterpret_cast<const char *>(&mapping), sizeof(mapping));
+  ++count_;
+}
+
+void StatsServer::Connection::FinishResponse(ipremap_status status,
+                                             bool more) {
+  ipremap_stats_header header;
+  header.status = static_cast<std::uint8_t>(status);
+  header.more = more;
+  header.count = htons(static_cast<std::uint16_t>(count_));
+  memcpy(&out_[0], &header, sizeof(header));
+  ready_ = true;
+}
+
+void StatsServer::Connection::ContinueDump(Mapper &mapper) {
+  mapper.ReadSnapshot(
+      *snapshot_,
+      [this](const Endpoint &orig, const Endpoint &nat,
+             std::chrono::system_clock::time_point last_access,
+             std::chrono::system_clock::duration ttl) {
+        const Endpoint &filtered =
+            filter_ == IPREMAP_FILTER_NAT ? nat : orig;
+        if (filter_ == IPREMAP_FILTER_NONE
+            || (filtered.addr.s_addr & mask_.s_addr) == prefix_.s_addr) {
+          Append(orig, nat, last_access, ttl);
+        }
+      });
+  if (snapshot_->done()) {
+    snapshot_.reset();
+    FinishResponse(IPREMAP_OK, false);
+  } else if (count_ > 0) {
+    // Sparse results wait for more rather than go out empty.
+    FinishResponse(IPREMAP_OK, true);
+  }
+}
+
+} // namespace ipremapd
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IPREMAPD_STATS_H_
+#define IPREMAPD_STATS_H_
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "fd_sets.h"
+#include "mapper.h"
+#include "protocol.h"
+
+namespace ipremapd {
+
+// Answers dumps of the mapping table and reverse lookups on a socket of
+// its own. Dumps read a snapshot of the table a few buckets per round, so
+// that clients are not held up however large the table is.
+class StatsServer {
+ public:
+  StatsServer(const std::shared_ptr<Mapper> &mapper,
+              const std::string &socket_path);
+  // Adopts the listening socket of a previous instance.
+  StatsServer(const std::shared_ptr<Mapper> &mapper,
+              const std::string &socket_path, int socket_fd);
+  StatsServer(const StatsServer &) = delete;
+  StatsServer &operator=(const StatsServer &) = delete;
+  ~StatsServer();
+
+  void Prepare(FdSets &fds) const;
+  void Dispatch(const FdSets &fds);
+
+  int socket_fd() const { return socket_fd_; }
+  // Leaves the socket path in place for a successor.
+  void Release() { socket_path_.clear(); }
+
+ private:
+  static constexpr int kBacklogSize = 4;
+
+  class Connection {
+   public:
+    explicit Connection(int fd);
+    Connection(const Connection &) = delete;
+    Connection(Connection &&);
+    Connection &operator=(const Connection &) = delete;
+    Connection &operator=(Connection &&);
+    ~Connection();
+
+    int fd() const { return fd_; }
+    // Whether a response is being sent, so that no request is read.
+    bool busy() const { return ready_ || snapshot_; }
+
+    void HandleReadable(Mapper &mapper);
+    void HandleWriteable(Mapper &mapper);
+
+   private:
+    void StartResponse();
+    void Append(const Endpoint &orig, const Endpoint &nat,
+                std::chrono::system_clock::time_point last_access,
+                std::chrono::system_clock::duration ttl);
+    void FinishResponse(ipremap_status status, bool more);
+    // Reads the next part of the snapshot into the response.
+    void ContinueDump(Mapper &mapper);
+
+    int fd_;
+    std::string out_;
+    std::size_t count_;
+    // Whether out_ is a complete message.
+    bool ready_;
+    std::shared_ptr<Mapper::Snapshot> snapshot_;
+    std::uint8_t filter_;
+    in_addr prefix_;
+    in_addr mask_;
+  };
+
+  void HandleAccept();
+
+  std::shared_ptr<Mapper> mapper_;
+  std::string socket_path_;
+  int socket_fd_;
+  std::vector<Connection> connections_;
+};
+
+} // namespace ipremapd
+
+#endif // IPREMAPD_STATS_H_
@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+namespace ipremapd {
+
+constexpr std::size_t TraceWriter::kBufferSize;
+constexpr std::size_t TraceWriter::kMaxBuffered;
+
+static const char kMagic[8] = {'i', 'p', 'r', 'e', 'm', 'a', 'p', 1};
+
+// request (1), op (1), protocol (1), padding (1), microseconds since the
+// epoch (8, big endian), client (4, big endian), original address (4) in
+// network byte order, requested time-to-live in seconds (4) and original
+// port (2), both big endian, and padding (2).
+static constexpr std::size_t kRecordSize = 28;
+
+static void EncodeRecord(char *buf, const TraceRecord &record) {
+  memset(buf, 0, kRecordSize);
+  buf[0] = static_cast<char>(record.request);
+  buf[1] = static_cast<char>(record.op);
+  buf[2] = static_cast<char>(record.orig.proto);
+  const std::uint64_t time = static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          record.time.time_since_epoch()).count());
+  for (int i = 0; i < 8; ++i) {
+    buf[4 + i] = static_cast<char>((time >> (56 - 8 * i)) & 0xff);
+  }
+  const std::uint32_t client = htonl(record.client);
+  memcpy(buf + 12, &client, sizeof(client));
+  memcpy(buf + 16, &record.orig.addr, sizeof(record.orig.addr));
+  const std::uint32_t ttl = htonl(static_cast<std::uint32_t>(
+      record.ttl.count()));
+  memcpy(buf + 20, &ttl, sizeof(ttl));
+  const std::uint16_t port = htons(record.orig.port);
+  memcpy(buf + 24, &port, sizeof(port));
+}
+
+static TraceRecord DecodeRecord(const char *buf) {
+  TraceRecord record;
+  record.request = static_cast<TraceRequest>(buf[0]);
+  if (record.request < TraceRequest::kLegacy
+      || record.request > TraceRequest::kPort) {
+    throw std::runtime_error("invalid request in trace.");
+  }
+  record.op = static_cast<std::uint8_t>(buf[1]);
+  record.orig.proto = static_cast<std::uint8_t>(buf[2]);
+  std::uint64_t time = 0;
+  for (int i = 0; i < 8; ++i) {
+    time = (time << 8) | static_cast<unsigned char>(buf[4 + i]);
+  }
+  record.time = std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::microseconds(time)));
+  std::uint32_t client, ttl;
+  memcpy(&client, buf + 12, sizeof(client));
+  record.client = ntohl(client);
+  memcpy(&record.orig.addr, buf + 16, sizeof(record.orig.addr));
+  memcpy(&ttl, buf + 20, sizeof(ttl));
+  record.ttl = std::chrono::seconds(ntohl(ttl));
+  std::uint16_t port;
+  memcpy(&port, buf + 24, sizeof(port));
+  record.orig.port = ntohs(port);
+  return record;
+}
+
+TraceWriter::TraceWriter(const std::string &path)
+    : dropped_(0), failed_(false) {
+  // A successor taking over appends to the trace of its predecessor.
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    throw std::runtime_error("cannot open trace file.");
+  }
+  struct stat st;
+  if (fstat(fd_, &st) < 0) {
+    close(fd_);
+    throw std::runtime_error("fstat failed.");
+  }
+  const std::size_t size = static_cast<std::size_t>(st.st_size);
+  if (size == 0) {
+    buffer_.assign(kMagic, sizeof(kMagic));
+  } else {
+    char magic[sizeof(kMagic)];
+    if (pread(fd_, magic, sizeof(magic), 0) != sizeof(magic)
+        || memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+      close(fd_);
+      throw std::runtime_error("not a trace file.");
+    }
+    // A daemon killed mid-write leaves a partial record, which would
+    // misalign the records appended after it.
+    const std::size_t partial = (size - sizeof(kMagic)) % kRecordSize;
+    if (partial != 0
+        && ftruncate(fd_, static_cast<off_t>(size - partial)) < 0) {
+      close(fd_);
+      throw std::runtime_error("ftruncate failed.");
+    }
+  }
+  buffer_.reserve(kBufferSize);
+}
+
+TraceWriter::~TraceWriter() {
+  Flush();
+  close(fd_);
+}
+
+void TraceWriter::Record(const TraceRecord &record) {
+  if (failed_) {
+    return;
+  }
+  if (buffer_.size() >= kMaxBuffered) {
+    ++dropped_;
+    return;
+  }
+  char buf[kRecordSize];
+  EncodeRecord(buf, record);
+  buffer_.append(buf, kRecordSize);
+}
+
+void TraceWriter::Flush() {
+  if (failed_) {
+    return;
+  }
+  if (dropped_ > 0) {
+    std::clog << "dropped " << dropped_ << " trace records." << std::endl;
+    dropped_ = 0;
+  }
+  std::size_t written = 0;
+  while (written < buffer_.size()) {
+    errno = 0;
+    ssize_t res = write(fd_, buffer_.data() + written,
+                        buffer_.size() - written);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    } else if (res <= 0) {
+      std::clog << "writing trace failed, tracing disabled." << std::endl;
+      failed_ = true;
+      std::string().swap(buffer_);
+      return;
+    }
+    written += static_cast<std::size_t>(res);
+  }
+  buffer_.clear();
+}
+
+std::vector<TraceRecord> ReadTrace(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("cannot open trace file.");
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    throw std::runtime_error("fstat failed.");
+  }
+  const std::size_t size = static_cast<std::size_t>(st.st_size);
+  if (size < sizeof(kMagic)) {
+    close(fd);
+    throw std::runtime_error("not a trace file.");
+  }
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("mmap failed.");
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+  const char *bytes = static_cast<const char *>(data);
+  std::vector<TraceRecord> records;
+  try {
+    if (memcmp(bytes, kMagic, sizeof(kMagic)) != 0) {
+      throw std::runtime_error("not a trace file.");
+    }
+    // A daemon killed mid-write leaves a partial record behind.
+    const std::size_t count = (size - sizeof(kMagic)) / kRecordSize;
+    records.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+      records.push_back(
+          DecodeRecord(bytes + sizeof(kMagic) + i * kRecordSize));
+    }
+  } catch (...) {
+    munmap(data, size);
+    throw;
+  }
+  munmap(data, size);
+  return records;
+}
+
+} // namespace ipremapd
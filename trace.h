@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IPREMAPD_TRACE_H_
+#define IPREMAPD_TRACE_H_
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "endpoint.h"
+
+namespace ipremapd {
+
+// The request formats told apart by the server.
+enum class TraceRequest : std::uint8_t {
+  kLegacy = 1, kLease, kPort
+};
+
+struct TraceRecord {
+  TraceRequest request;
+  // Zero for legacy requests.
+  std::uint8_t op;
+  std::chrono::system_clock::time_point time;
+  // Distinguishes the connections of one daemon.
+  std::uint32_t client;
+  Endpoint orig;
+  std::chrono::seconds ttl;
+};
+
+// Appends requests to a trace file, buffering them to keep writes off the
+// request path until Flush(), which the daemon calls once a second. Tracing
+// never takes the daemon down: records beyond kMaxBuffered are dropped,
+// and a failed write disables tracing. Daemons handing over to each other
+// may append to the same file.
+class TraceWriter {
+ public:
+  // Throws if path exists but is not a trace file.
+  explicit TraceWriter(const std::string &path);
+  TraceWriter(const TraceWriter &) = delete;
+  TraceWriter &operator=(const TraceWriter &) = delete;
+  ~TraceWriter();
+
+  void Record(const TraceRecord &record);
+  void Flush();
+
+ private:
+  static constexpr std::size_t kBufferSize = 64 * 1024;
+  static constexpr std::size_t kMaxBuffered = 16 * 1024 * 1024;
+
+  int fd_;
+  std::string buffer_;
+  std::uint64_t dropped_;
+  bool failed_;
+};
+
+// Reads a whole trace through a memory mapping.
+std::vector<TraceRecord> ReadTrace(const std::string &path);
+
+} // namespace ipremapd
+
+#endif // IPREMAPD_TRACE_H_
@@ -0,0 +1,420 @@
+/*
+ * Copyright (C) 2014 Kristof Marussy <kris7topher@gmail.com>
+ *
+ * This file is part of Ipremap.
+ *
+ * Ipremap is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ipremap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ipremap.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays a trace recorded with ipremapd --trace against the mapping table
+// and a simulated chain, faster than real time, and reports how each table
+// configuration would have fared. Every combination of the comma-separated
+// sizes, TTLs and policies is replayed.
+//
+// The daemon serves one request at a time, so a request waits for the rule
+// changes of those before it. A simulated iptables command costs the exec
+// latency plus the rule latency for each rule it changes. Replay uses a
+// NAT pool much larger than any table, since collisions in the pool hardly
+// matter, and maps ports if the trace has port requests.
+//
+// usage: trace_replay [options] TRACE
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include "basic_mapper.h"
+#include "clock.h"
+#include "mapper.h"
+#include "remap_chain.h"
+#include "server.h"
+#include "trace.h"
+
+namespace {
+
+using namespace ipremapd;
+
+typedef std::chrono::duration<double, std::milli> milliseconds;
+
+struct Options {
+  std::vector<std::size_t> max_sizes = {32};
+  std::vector<std::chrono::seconds> ttls = {std::chrono::seconds(300)};
+  std::vector<EvictionPolicy> policies = {EvictionPolicy::kLru};
+  // Negative leaves the longest lease at the TTL.
+  long max_ttl = -1;
+  unsigned long low_watermark = 0;
+  unsigned long high_watermark = 0;
+  std::chrono::microseconds exec_latency{2000};
+  std::chrono::microseconds rule_latency{50};
+  std::string trace;
+};
+
+enum LongOption {
+  kMaxTtl = 256,
+  kEviction,
+  kWatermarks,
+  kExecLatency,
+  kRuleLatency
+};
+
+class SimulatedChain : public RuleSink {
+ public:
+  SimulatedChain(std::chrono::microseconds exec_latency,
+                 std::chrono::microseconds rule_latency)
+      : exec_latency_(exec_latency), rule_latency_(rule_latency),
+        busy_(0), commands_(0), added_(0), deleted_(0) {
+  }
+
+  void Apply(std::size_t added, std::size_t deleted) override {
+    busy_ += exec_latency_
+        + rule_latency_ * static_cast<long>(added + deleted);
+    ++commands_;
+    added_ += added;
+    deleted_ += deleted;
+  }
+  void Flush() override {}
+
+  // The total time spent in iptables.
+  std::chrono::microseconds busy() const { return busy_; }
+  std::uint64_t commands() const { return commands_; }
+  std::uint64_t added() const { return added_; }
+  std::uint64_t deleted() const { return deleted_; }
+
+ private:
+  std::chrono::microseconds exec_latency_;
+  std::chrono::microseconds rule_latency_;
+  std::chrono::microseconds busy_;
+  std::uint64_t commands_;
+  std::uint64_t added_;
+  std::uint64_t deleted_;
+};
+
+struct Config {
+  EvictionPolicy policy;
+  const char *policy_name;
+  std::size_t max_size;
+  std::chrono::seconds ttl;
+};
+
+void Usage(const char *argv0) {
+  std::cerr << "usage: " << argv0 << " [options] TRACE\n"
+      "  -n, --max-size=COUNT,...   maximum numbers of mappings (default: 32)\n"
+      "  -t, --ttl=SECONDS,...      mapping time-to-lives, 0 is forever\n"
+      "                             (default: 300)\n"
+      "      --max-ttl=SECONDS      longest lease clients may request, 0 is\n"
+      "                             unlimited (default: the TTL)\n"
+      "      --eviction=POLICY,...  lru, clock, ttl or frequency\n"
+      "                             (default: lru)\n"
+      "      --watermarks=LOW,HIGH  evict in bulk as ipremapd does\n"
+      "      --exec-latency=USEC    cost of an iptables command\n"
+      "                             (default: 2000)\n"
+      "      --rule-latency=USEC    cost of changing a rule (default: 50)\n";
+}
+
+std::vector<std::string> SplitList(const std::string &str) {
+  std::vector<std::string> items;
+  std::istringstream in(str);
+  std::string item;
+  while (std::getline(in, item, ',')) {
+    items.push_back(item);
+  }
+  if (items.empty()) {
+    throw std::invalid_argument("empty list.");
+  }
+  return items;
+}
+
+EvictionPolicy ParseEviction(const std::string &str) {
+  if (str == "lru") {
+    return EvictionPolicy::kLru;
+  } else if (str == "clock") {
+    return EvictionPolicy::kClock;
+  } else if (str == "ttl") {
+    return EvictionPolicy::kTtlOnly;
+  } else if (str == "frequency") {
+    return EvictionPolicy::kFrequency;
+  }
+  throw std::invalid_argument("unknown eviction policy.");
+}
+
+const char *PolicyName(EvictionPolicy policy) {
+  switch (policy) {
+    case EvictionPolicy::kLru:
+      return "lru";
+    case EvictionPolicy::kClock:
+      return "clock";
+    case EvictionPolicy::kTtlOnly:
+      return "ttl";
+    case EvictionPolicy::kFrequency:
+      return "frequency";
+  }
+  throw std::logic_error("unknown eviction policy.");
+}
+
+Options ParseOptions(int argc, char *argv[]) {
+  static const option long_options[] = {
+    {"max-size", required_argument, nullptr, 'n'},
+    {"ttl", required_argument, nullptr, 't'},
+    {"max-ttl", required_argument, nullptr, kMaxTtl},
+    {"eviction", required_argument, nullptr, kEviction},
+    {"watermarks", required_argument, nullptr, kWatermarks},
+    {"exec-latency", required_argument, nullptr, kExecLatency},
+    {"rule-latency", required_argument, nullptr, kRuleLatency},
+    {"help", no_argument, nullptr, 'h'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  Options options;
+  int c;
+  while ((c = getopt_long(argc, argv, "n:t:h", long_options, nullptr))
+         != -1) {
+    switch (c) {
+      case 'n':
+        options.max_sizes.clear();
+        for (const auto &item : SplitList(optarg)) {
+          options.max_sizes.push_back(std::stoul(item));
+          if (options.max_sizes.back() == 0) {
+            throw std::invalid_argument("max-size must be positive.");
+          }
+        }
+        break;
+      case 't':
+        options.ttls.clear();
+        for (const auto &item : SplitList(optarg)) {
+          options.ttls.emplace_back(std::stoul(item));
+        }
+        break;
+      case kMaxTtl:
+        options.max_ttl = static_cast<long>(std::stoul(optarg));
+        break;
+      case kEviction:
+        options.policies.clear();
+        for (const auto &item : SplitList(optarg)) {
+          options.policies.push_back(ParseEviction(item));
+        }
+        break;
+      case kWatermarks: {
+        const std::vector<std::string> marks = SplitList(optarg);
+        if (marks.size() != 2) {
+          throw std::invalid_argument("watermarks must be given as LOW,HIGH.");
+        }
+        options.low_watermark = std::stoul(marks[0]);
+        options.high_watermark = std::stoul(marks[1]);
+        if (options.high_watermark > 100
+            || options.low_watermark > options.high_watermark) {
+          throw std::invalid_argument("invalid watermarks.");
+        }
+        break;
+      }
+      case kExecLatency:
+        options.exec_latency = std::chrono::microseconds(std::stoul(optarg));
+        break;
+      case kRuleLatency:
+        options.rule_latency = std::chrono::microseconds(std::stoul(optarg));
+        break;
+      case 'h':
+        Usage(argv[0]);
+        exit(EXIT_SUCCESS);
+      default:
+        Usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (optind + 1 != argc) {
+    Usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  options.trace = argv[optind];
+  return options;
+}
+
+NatPool ReplayPool(const std::vector<TraceRecord> &trace) {
+  NatPool pool = NatPool();
+  inet_pton(AF_INET, "10.0.0.0", &pool.range);
+  inet_pton(AF_INET, "255.0.0.0", &pool.mask);
+  for (const auto &record : trace) {
+    if (record.request == TraceRequest::kPort) {
+      pool.first_port = 1024;
+      pool.last_port = 65535;
+      break;
+    }
+  }
+  return pool;
+}
+
+template <typename M>
+void Serve(M &mapper, const TraceRecord &record) {
+  if (record.request == TraceRequest::kLegacy) {
+    if (mapper.Accepts(record.orig)) {
+      mapper.Map(record.orig);
+    }
+    return;
+  }
+  Endpoint nat;
+  std::chrono::system_clock::duration granted_ttl;
+  HandleRequest(mapper, record.op, record.ttl, record.orig, &nat,
+                &granted_ttl);
+}
+
+double Percentile(const std::vector<double> &sorted, double p) {
+  const std::size_t i = static_cast<std::size_t>(p * (sorted.size() - 1));
+  return sorted[i];
+}
+
+// Replays trace on the mapper type picked by config.policy.
+template <typename Policy>
+struct Replay {
+  static void Run(const Options &options, const NatPool &pool,
+                  const Config &config,
+                  const std::vector<TraceRecord> &trace) {
+    const auto start = trace.front().time;
+    MapperClock::Set(start);
+    auto chain = std::make_shared<SimulatedChain>(options.exec_latency,
+                                                  options.rule_latency);
+    auto mapper = std::make_shared<BasicMapper<Policy>>(
+        RemapChain("replay", chain), pool, config.max_size, config.ttl);
+    if (options.max_ttl >= 0) {
+      mapper->set_max_ttl(std::chrono::seconds(options.max_ttl));
+    }
+    mapper->set_watermarks(config.max_size * options.low_watermark / 100,
+                           config.max_size * options.high_watermark / 100);
+    std::uint64_t expired = 0;
+    mapper->set_event_callback(
+        [&expired](MapperEvent event, const Endpoint &, const Endpoint &,
+                   std::chrono::system_clock::duration) {
+          expired += event == MapperEvent::kExpire;
+        });
+
+    auto wall_start = std::chrono::steady_clock::now();
+    std::vector<double> latencies;
+    latencies.reserve(trace.size());
+    std::size_t peak = 0;
+    // Requests the mapper rejects never reach the table.
+    std::uint64_t lookups = 0;
+    auto idle = start;
+    auto free = start;
+    for (const auto &record : trace) {
+      auto now = std::max(record.time, free);
+      MapperClock::Set(now);
+      auto busy = chain->busy();
+      lookups += (record.request == TraceRequest::kLegacy
+                  || record.op == IPREMAP_MAP)
+          && mapper->Accepts(record.orig);
+      Serve(*mapper, record);
+      // Idle() runs every select round in ipremapd, but expiry has a
+      // resolution of seconds anyway.
+      mapper->CommitReleases();
+      if (now - idle >= std::chrono::seconds(1)) {
+        mapper->Idle();
+        idle = now;
+      }
+      now += chain->busy() - busy;
+      latencies.push_back(milliseconds(now - record.time).count());
+      peak = std::max(peak, mapper->mapped_count());
+
+      // Runs once the response is out, but delays the next request.
+      MapperClock::Set(now);
+      busy = chain->busy();
+      mapper->Reclaim();
+      free = now + (chain->busy() - busy);
+    }
+    std::chrono::duration<double> wall_elapsed =
+        std::chrono::steady_clock::now() - wall_start;
+    std::chrono::duration<double> simulated = free - start;
+    const MapperStats stats = mapper->stats();
+    mapper.reset();
+    MapperClock::Set(MapperClock::time_point());
+
+    std::sort(latencies.begin(), latencies.end());
+    const double hits = lookups > stats.misses
+        ? 100.0 * (lookups - stats.misses) / lookups : 0;
+    std::cout << std::setw(10) << config.policy_name
+              << std::setw(9) << config.max_size
+              << std::setw(7) << config.ttl.count()
+              << std::fixed << std::setprecision(2)
+              << std::setw(9) << hits
+              << std::setw(8) << peak
+              << std::setw(9) << stats.evictions
+              << std::setw(9) << expired
+              << std::setw(9) << stats.reclaimed
+              << std::setw(9) << chain->commands()
+              << std::setw(9) << chain->added()
+              << std::setw(9) << chain->deleted()
+              << std::setprecision(3)
+              << std::setw(9) << Percentile(latencies, 0.5)
+              << std::setw(9) << Percentile(latencies, 0.99)
+              << std::setw(9) << Percentile(latencies, 0.999)
+              << std::setw(9) << latencies.back()
+              << std::setprecision(0)
+              << std::setw(9) << simulated.count() / wall_elapsed.count()
+              << std::endl;
+
+  }
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    Options options = ParseOptions(argc, argv);
+    std::vector<TraceRecord> trace = ReadTrace(options.trace);
+    if (trace.empty()) {
+      throw std::runtime_error("empty trace.");
+    }
+    // Clients of one daemon share a clock, but a trace may splice several.
+    std::stable_sort(trace.begin(), trace.end(),
+                     [](const TraceRecord &a, const TraceRecord &b) {
+                       return a.time < b.time;
+                     });
+    const NatPool pool = ReplayPool(trace);
+
+    std::chrono::duration<double> span = trace.back().time - trace.front().time;
+    std::cout << trace.size() << " requests over " << std::fixed
+              << std::setprecision(1) << span.count() << " s"
+              << (pool.port_mode() ? ", mapping ports" : "") << "\n"
+              << std::setw(10) << "policy" << std::setw(9) << "size"
+              << std::setw(7) << "ttl" << std::setw(9) << "hits (%)"
+              << std::setw(8) << "peak" << std::setw(9) << "evicted"
+              << std::setw(9) << "expired" << std::setw(9) << "reclaim"
+              << std::setw(9) << "commands" << std::setw(9) << "added"
+              << std::setw(9) << "deleted" << std::setw(9) << "p50 (ms)"
+              << std::setw(9) << "p99" << std::setw(9) << "p99.9"
+              << std::setw(9) << "max" << std::setw(9) << "speedup"
+              << std::endl;
+    for (auto policy : options.policies) {
+      for (auto max_size : options.max_sizes) {
+        for (auto ttl : options.ttls) {
+          const Config config = {policy, PolicyName(policy), max_size, ttl};
+          WithPolicy<Replay>(policy, options, pool, config, trace);
+        }
+      }
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}